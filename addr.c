@@ -58,10 +58,24 @@ static char * _stripEmail( char *str )
     return str;
 }
 
+/*
+ * The pair and its strings come from the kmem wrappers, klib's
+ * pair_Delete() would free them past the counters.
+ */
+void deleteAddr( void * addr )
+{
+    Pair pair = (Pair)addr;
+
+    if( !pair ) return;
+    Free( A_NAME(pair) );
+    Free( A_EMAIL(pair) );
+    Free( pair );
+}
+
 Pair createAddr( const char * src )
 {
     char * scopy;
-    Pair addr = pair_Create( NULL, NULL);
+    Pair addr = Calloc( sizeof(*addr), 1 );
     if( !addr ) return NULL;
     scopy = Strdup( src );
     if( !scopy )
@@ -84,7 +98,7 @@ Pair createAddr( const char * src )
         tok = strtok( tok, ">" );
         if( tok == NULL )
         {
-            pair_Delete( addr );
+            deleteAddr( addr );
             Free( scopy );
             return NULL;
         }
@@ -93,7 +107,7 @@ Pair createAddr( const char * src )
             A_EMAIL(addr) = Strdup( tok );
             if( !A_EMAIL(addr) )
             {
-                pair_Delete( addr );
+                deleteAddr( addr );
                 Free( scopy );
                 return NULL;
             }
@@ -104,7 +118,7 @@ Pair createAddr( const char * src )
         A_EMAIL(addr) = Strdup( scopy );
         if( !A_EMAIL(addr) )
         {
-            pair_Delete( addr );
+            deleteAddr( addr );
             Free( scopy );
             return NULL;
         }
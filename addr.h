@@ -15,5 +15,6 @@
 #define A_NAME( pair )  (pair)->first
 
 Pair createAddr( const char * src );
+void deleteAddr( void * addr );
 
 #endif /* ADDR_H_ */
@@ -0,0 +1,431 @@
+/*
+ * bench.c, part of "ksmtp" project.
+ *
+ *  Micro-benchmarks for MIME and message building:
+ *
+ *      cc -O2 -pthread -o kbench bench.c kmsg.c addr.c mime.c rcpt.c \
+ *          kbuf.c kpipe.c kqueue.c kio.c kmem.c kzip.c kfilter.c \
+ *          ../klib/... ../stringlib/... -lz
+ *
+ *  Usage: kbench [-d] [-g golden_dir] [-t min_seconds] [filter]
+ *      -d  deterministic mode: fixed boundaries and Date
+ *      -g  write every corpus message to golden_dir/<name>.eml (implies -d)
+ *  Results are printed to stdout as JSON.
+ */
+
+#include "kmsg_int.h"
+#include "addr.h"
+#include "mime.h"
+#include <errno.h>
+#include <time.h>
+
+#define BENCH_DATE      "Thu, 01 Jan 2015 00:00:00 +0000"
+#define BENCH_MSGID     "<kbench@localhost>"
+#define BENCH_BOUNDARY  "=-kbenchkbenchkbenchkbenchkbench"
+
+/*
+ * glibc: count every allocation, including stringlib and klib ones.
+ */
+#ifdef __GLIBC__
+extern void * __libc_malloc( size_t size );
+extern void * __libc_calloc( size_t n, size_t size );
+extern void * __libc_realloc( void * ptr, size_t size );
+
+static size_t _allocs;
+static size_t _alloc_bytes;
+
+void * malloc( size_t size )
+{
+    _allocs++;
+    _alloc_bytes += size;
+    return __libc_malloc( size );
+}
+
+void * calloc( size_t n, size_t size )
+{
+    _allocs++;
+    _alloc_bytes += n * size;
+    return __libc_calloc( n, size );
+}
+
+void * realloc( void * ptr, size_t size )
+{
+    _allocs++;
+    _alloc_bytes += size;
+    return __libc_realloc( ptr, size );
+}
+#else
+static size_t _allocs;
+static size_t _alloc_bytes;
+#endif
+
+static int deterministic = 0;
+static double min_time = 0.5;
+static const char * filter = NULL;
+static const char * golden = NULL;
+static int first_result = 1;
+
+static const char * subjects[][2] =
+{
+{ "ascii", "Quarterly report for the board of directors, please read" },
+{ "cyrillic", "А вот как насчёт такого очень-очень-очень офигенно длинного"
+        " поля сабжект?" },
+{ "cjk", "四半期報告書：取締役会向けの資料をご確認ください" } };
+
+static size_t body_sizes[] =
+{ 1024, 100 * 1024, 10 * 1024 * 1024 };
+
+static size_t rcpt_counts[] =
+{ 1, 100, 10000 };
+
+static double now( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef int (*BenchFn)( void * arg );
+
+static void bench( const char * name, BenchFn fn, void * arg )
+{
+    size_t n = 1;
+    size_t i;
+    size_t allocs, bytes;
+    double start, elapsed;
+
+    if( filter && !strstr( name, filter ) ) return;
+
+    for( ;; )
+    {
+        allocs = _allocs;
+        bytes = _alloc_bytes;
+        start = now();
+        for( i = 0; i < n; i++ )
+        {
+            if( !fn( arg ) )
+            {
+                fprintf( stderr, "%s: failed\n", name );
+                return;
+            }
+        }
+        elapsed = now() - start;
+        if( elapsed >= min_time || n >= ((size_t)1 << 30) ) break;
+        n = elapsed > 0.001 ? (size_t)(n * min_time / elapsed * 1.2) + 1 : n * 10;
+    }
+    printf( "%s\n  { \"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.1f,"
+            " \"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f }",
+            first_result ? "" : ",", name, n, elapsed * 1e9 / n,
+            (double)(_allocs - allocs) / n,
+            (double)(_alloc_bytes - bytes) / n );
+    first_result = 0;
+    fflush( stdout );
+}
+
+/*
+ * Corpus
+ */
+static char * makeText( size_t size, int utf )
+{
+    static const char ascii[] = "The quick brown fox jumps over the lazy dog. ";
+    static const char cyr[] = "Съешь же ещё этих мягких французских булок. ";
+    const char * src = utf ? cyr : ascii;
+    size_t len = strlen( src );
+    size_t i;
+    char * text = Malloc( size + 1 );
+    if( !text ) return NULL;
+
+    for( i = 0; i + len < size; i += len )
+    {
+        memcpy( text + i, src, len );
+        if( !((i / len + 1) % 2) ) text[i + len - 1] = '\n';
+    }
+    memset( text + i, 'x', size - i );
+    text[size] = 0;
+    return text;
+}
+
+static void freeze( KMsg msg )
+{
+    if( !deterministic ) return;
+    msg_Freeze( msg );
+    strcpy( msg->date, BENCH_DATE );
+    strcpy( msg->msgid, BENCH_MSGID );
+    strcpy( msg->boundary[MSG_B_ALT], BENCH_BOUNDARY "A" );
+    strcpy( msg->boundary[MSG_B_REL], BENCH_BOUNDARY "R" );
+    strcpy( msg->boundary[MSG_B_MIX], BENCH_BOUNDARY "M" );
+}
+
+static KMsg makeMsg( const char * subject, size_t rcpts, const char * body,
+        const char * charset )
+{
+    size_t i;
+    char addr[128];
+    KMsg msg = msg_Create();
+    if( !msg ) return NULL;
+
+    msg_SetFrom( msg, "Бумбастик <sender@example.com>" );
+    msg_SetSubject( msg, subject );
+    for( i = 0; i < rcpts; i++ )
+    {
+        snprintf( addr, sizeof(addr), "%s %zu <user%zu@domain%zu.example>",
+                i % 2 ? "Получатель" : "Recipient", i, i, i % 97 );
+        msg_AddTo( msg, addr );
+    }
+    if( body ) msg_AddTextPart( msg, body, "plain", charset );
+    msg_AddHeader( msg, "X-Custom-One", "One" );
+    freeze( msg );
+    return msg;
+}
+
+static int fileWriter( void * ctx, const char * buf, size_t size )
+{
+    return fwrite( buf, 1, size, (FILE *)ctx ) == size;
+}
+
+static void writeGolden( const char * name, KMsg msg )
+{
+    char path[1024];
+    char * ptr;
+    FILE * f;
+    string error;
+
+    if( !golden ) return;
+    snprintf( path, sizeof(path), "%s/%s.eml", golden, name );
+    for( ptr = path + strlen( golden ) + 1; *ptr; ptr++ )
+        if( *ptr == '/' ) *ptr = '_';
+    f = fopen( path, "wb" );
+    if( !f )
+    {
+        fprintf( stderr, "%s: %s\n", path, strerror( errno ) );
+        return;
+    }
+    error = snew();
+    if( !msg_Write( msg, fileWriter, f, error ) )
+    {
+        fprintf( stderr, "%s: %s\n", path, sstr( error ) );
+    }
+    sdel( error );
+    fclose( f );
+}
+
+/*
+ * Benchmarks
+ */
+typedef struct _BenchArg
+{
+    KMsg msg;
+    const char * str;
+    const char * str2;
+}*BenchArg;
+
+static int b_encodeb64( void * arg )
+{
+    BenchArg a = arg;
+    string s = msg_EncodeB64( a->msg->cprefix, a->str );
+    sdel( s );
+    return s != NULL;
+}
+
+static int b_makeEncodedHeader( void * arg )
+{
+    BenchArg a = arg;
+    string s = snew();
+    int rc = s && msg_EncodeHeader( a->msg, "Subject", a->str, s );
+    sdel( s );
+    return rc;
+}
+
+static int b_makeAddrList( void * arg )
+{
+    BenchArg a = arg;
+    string s = snew();
+    int rc = s && msg_EncodeAddrList( a->msg, "To", RCPT_TO, s );
+    sdel( s );
+    return rc;
+}
+
+/*
+ * Cold: every pass starts without the header and text part caches, as a
+ * new message does. Warm: the caches from the previous pass are reused.
+ */
+static void invalidate( KMsg msg )
+{
+    msg_Invalidate( msg );
+    if( deterministic ) strcpy( msg->msgid, BENCH_MSGID );
+}
+
+static int b_msg_CreateHeaders( void * arg )
+{
+    BenchArg a = arg;
+    string s;
+
+    invalidate( a->msg );
+    s = msg_CreateHeaders( a->msg );
+    sdel( s );
+    return s != NULL;
+}
+
+static int b_msg_CreateHeadersWarm( void * arg )
+{
+    BenchArg a = arg;
+    string s = msg_CreateHeaders( a->msg );
+    sdel( s );
+    return s != NULL;
+}
+
+static int b_msg_CreateBody( void * arg )
+{
+    BenchArg a = arg;
+    string s;
+
+    invalidate( a->msg );
+    s = msg_CreateBody( a->msg );
+    sdel( s );
+    return s != NULL;
+}
+
+static int b_msg_CreateBodyWarm( void * arg )
+{
+    BenchArg a = arg;
+    string s = msg_CreateBody( a->msg );
+    sdel( s );
+    return s != NULL;
+}
+
+static int b_getMimeType( void * arg )
+{
+    BenchArg a = arg;
+    return getMimeType( a->str, NULL ) != NULL;
+}
+
+static int b_isUsAscii( void * arg )
+{
+    BenchArg a = arg;
+    return isUsAscii( a->str ) >= 0;
+}
+
+static int b_createAddr( void * arg )
+{
+    BenchArg a = arg;
+    Pair p = createAddr( a->str );
+    deleteAddr( p );
+    return p != NULL;
+}
+
+static int b_mimeFileName( void * arg )
+{
+    BenchArg a = arg;
+    string s = mimeFileName( a->str, a->str2 );
+    sdel( s );
+    return s != NULL;
+}
+
+int main( int argc, char * argv[] )
+{
+    struct _BenchArg a;
+    char name[128];
+    size_t i, j;
+    KMsg msg;
+    char * text;
+    int opt;
+
+    for( opt = 1; opt < argc; opt++ )
+    {
+        if( !strcmp( argv[opt], "-d" ) ) deterministic = 1;
+        else if( !strcmp( argv[opt], "-g" ) && opt + 1 < argc )
+        {
+            golden = argv[++opt];
+            deterministic = 1;
+        }
+        else if( !strcmp( argv[opt], "-t" ) && opt + 1 < argc ) min_time = atof(
+                argv[++opt] );
+        else filter = argv[opt];
+    }
+
+    printf( "{ \"deterministic\": %s, \"results\": [", deterministic ? "true" : "false" );
+
+    memset( &a, 0, sizeof(a) );
+    a.msg = msg_Create();
+    for( i = 0; i < sizeof(subjects) / sizeof(subjects[0]); i++ )
+    {
+        a.str = subjects[i][1];
+        snprintf( name, sizeof(name), "encodeb64/%s", subjects[i][0] );
+        bench( name, b_encodeb64, &a );
+        snprintf( name, sizeof(name), "makeEncodedHeader/%s", subjects[i][0] );
+        bench( name, b_makeEncodedHeader, &a );
+        snprintf( name, sizeof(name), "isUsAscii/%s", subjects[i][0] );
+        bench( name, b_isUsAscii, &a );
+    }
+    msg_Destroy( a.msg );
+
+    for( i = 0; i < sizeof(rcpt_counts) / sizeof(rcpt_counts[0]); i++ )
+    {
+        for( j = 0; j < sizeof(subjects) / sizeof(subjects[0]); j++ )
+        {
+            msg = makeMsg( subjects[j][1], rcpt_counts[i], "text", NULL );
+            if( !msg ) return 1;
+            a.msg = msg;
+            snprintf( name, sizeof(name), "msg_CreateHeaders/%s/rcpt%zu",
+                    subjects[j][0], rcpt_counts[i] );
+            bench( name, b_msg_CreateHeaders, &a );
+            writeGolden( name, msg );
+            snprintf( name, sizeof(name), "msg_CreateHeaders/%s/rcpt%zu/warm",
+                    subjects[j][0], rcpt_counts[i] );
+            bench( name, b_msg_CreateHeadersWarm, &a );
+            if( !j )
+            {
+                snprintf( name, sizeof(name), "makeAddrList/rcpt%zu",
+                        rcpt_counts[i] );
+                bench( name, b_makeAddrList, &a );
+            }
+            msg_Destroy( msg );
+        }
+    }
+
+    for( i = 0; i < sizeof(body_sizes) / sizeof(body_sizes[0]); i++ )
+    {
+        for( j = 0; j < 2; j++ )
+        {
+            text = makeText( body_sizes[i], (int)j );
+            if( !text ) return 1;
+            msg = makeMsg( subjects[j][1], 1, text, j ? "UTF-8" : "us-ascii" );
+            if( !msg ) return 1;
+            a.msg = msg;
+            snprintf( name, sizeof(name), "msg_CreateBody/%s/%zu",
+                    j ? "utf8" : "ascii", body_sizes[i] );
+            bench( name, b_msg_CreateBody, &a );
+            writeGolden( name, msg );
+            snprintf( name, sizeof(name), "msg_CreateBody/%s/%zu/warm",
+                    j ? "utf8" : "ascii", body_sizes[i] );
+            bench( name, b_msg_CreateBodyWarm, &a );
+            a.str = text;
+            snprintf( name, sizeof(name), "isUsAscii/body%s/%zu",
+                    j ? "utf8" : "ascii", body_sizes[i] );
+            bench( name, b_isUsAscii, &a );
+            msg_Destroy( msg );
+            Free( text );
+        }
+    }
+
+    a.str = "report.csv";
+    bench( "getMimeType/csv", b_getMimeType, &a );
+    a.str = "archive.zoo";
+    bench( "getMimeType/last", b_getMimeType, &a );
+    a.str = "noextension";
+    bench( "getMimeType/none", b_getMimeType, &a );
+
+    a.str = "user@example.com";
+    bench( "createAddr/plain", b_createAddr, &a );
+    a.str = "\"Иван Петров\" <ivan.petrov@example.com>";
+    bench( "createAddr/named", b_createAddr, &a );
+
+    a.str = "/tmp/reports/2015/report.pdf";
+    a.str2 = "UTF-8";
+    bench( "mimeFileName/ascii", b_mimeFileName, &a );
+    a.str = "/tmp/reports/2015/отчёт за квартал.pdf";
+    bench( "mimeFileName/cyrillic", b_mimeFileName, &a );
+
+    printf( "\n] }\n" );
+    return 0;
+}
@@ -0,0 +1,472 @@
+/*
+ * dkim.c, part of "ksmtp" project.
+ */
+
+#include "dkim.h"
+#include "../stringlib/b64.h"
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <errno.h>
+#include <time.h>
+
+#define DKIM_FOLD_SIZE  72
+
+KDkim dkim_Create( const char * domain, const char * selector,
+        const char * keyfile, string error )
+{
+    FILE * f;
+    KDkim dkim = Calloc( sizeof(struct _KDkim), 1 );
+    if( !dkim )
+    {
+        scpyc( error, "dkim_Create(), internal error [1]" );
+        return NULL;
+    }
+
+    dkim->domain = Strdup( domain );
+    dkim->selector = Strdup( selector );
+    dkim->sign_headers = Strdup( DKIM_DEFAULT_HEADERS );
+    dkim->bh = EVP_MD_CTX_new();
+    if( !dkim->domain || !dkim->selector || !dkim->sign_headers || !dkim->bh )
+    {
+        scpyc( error, "dkim_Create(), internal error [2]" );
+        dkim_Destroy( dkim );
+        return NULL;
+    }
+
+    f = fopen( keyfile, "r" );
+    if( !f )
+    {
+        sprint( error, "dkim_Create(\"%s\") : %s", keyfile, strerror( errno ) );
+        dkim_Destroy( dkim );
+        return NULL;
+    }
+    dkim->key = PEM_read_PrivateKey( f, NULL, NULL, NULL );
+    fclose( f );
+    if( !dkim->key )
+    {
+        sprint( error, "dkim_Create(\"%s\") : invalid private key", keyfile );
+        dkim_Destroy( dkim );
+        return NULL;
+    }
+    if( EVP_PKEY_id( dkim->key ) != EVP_PKEY_RSA
+            && EVP_PKEY_id( dkim->key ) != EVP_PKEY_ED25519 )
+    {
+        sprint( error, "dkim_Create(\"%s\") : only RSA and Ed25519 keys are"
+                " supported", keyfile );
+        dkim_Destroy( dkim );
+        return NULL;
+    }
+    return dkim;
+}
+
+void dkim_Destroy( KDkim dkim )
+{
+    if( !dkim ) return;
+    Free( dkim->domain );
+    Free( dkim->selector );
+    Free( dkim->sign_headers );
+    Free( dkim->hdrs );
+    EVP_MD_CTX_free( dkim->bh );
+    EVP_PKEY_free( dkim->key );
+    Free( dkim );
+}
+
+int dkim_SetHeaders( KDkim dkim, const char * headers )
+{
+    char * h = Strdup( headers );
+    if( h )
+    {
+        Free( dkim->sign_headers );
+        dkim->sign_headers = h;
+        return 1;
+    }
+    return 0;
+}
+
+int dkim_Begin( KDkim dkim )
+{
+    dkim->hdrs_size = 0;
+    dkim->size = 0;
+    dkim->in_body = 0;
+    dkim->eoh = 0;
+    dkim->cr = 0;
+    dkim->wsp = 0;
+    dkim->crlf = 0;
+    dkim->content = 0;
+    return EVP_DigestInit_ex( dkim->bh, EVP_sha256(), NULL );
+}
+
+static int addHeaders( KDkim dkim, const char * buf, size_t size )
+{
+    if( dkim->hdrs_size + size > dkim->hdrs_bsize )
+    {
+        size_t bsize = dkim->hdrs_bsize ? dkim->hdrs_bsize : 1024;
+        char * hdrs;
+        while( bsize < dkim->hdrs_size + size )
+            bsize *= 2;
+        hdrs = Realloc( dkim->hdrs, bsize );
+        if( !hdrs ) return 0;
+        dkim->hdrs = hdrs;
+        dkim->hdrs_bsize = bsize;
+    }
+    memcpy( dkim->hdrs + dkim->hdrs_size, buf, size );
+    dkim->hdrs_size += size;
+    return 1;
+}
+
+/*
+ * RFC 6376, 3.4.4: relaxed body canonicalization, one pass, no copies.
+ */
+#define BODY_PUT( ch ) \
+    do { \
+        out[n++] = (ch); \
+        if( n == sizeof(out) ) \
+        { \
+            if( !EVP_DigestUpdate( dkim->bh, out, n ) ) return 0; \
+            n = 0; \
+        } \
+    } while( 0 )
+
+static int hashBody( KDkim dkim, const char * buf, size_t size )
+{
+    char out[4096];
+    size_t n = 0;
+    size_t i;
+
+    for( i = 0; i < size; i++ )
+    {
+        char c = buf[i];
+        if( dkim->cr )
+        {
+            dkim->cr = 0;
+            if( c == '\n' )
+            {
+                dkim->wsp = 0;
+                dkim->crlf++;
+                continue;
+            }
+            i--;
+            c = '\r';
+        }
+        else if( c == '\r' )
+        {
+            dkim->cr = 1;
+            continue;
+        }
+        else if( c == '\n' )
+        {
+            dkim->wsp = 0;
+            dkim->crlf++;
+            continue;
+        }
+        else if( c == ' ' || c == '\t' )
+        {
+            dkim->wsp = 1;
+            continue;
+        }
+
+        while( dkim->crlf )
+        {
+            BODY_PUT( '\r' );
+            BODY_PUT( '\n' );
+            dkim->crlf--;
+        }
+        if( dkim->wsp )
+        {
+            BODY_PUT( ' ' );
+            dkim->wsp = 0;
+        }
+        BODY_PUT( c );
+        dkim->content = 1;
+    }
+    return n ? EVP_DigestUpdate( dkim->bh, out, n ) : 1;
+}
+
+int dkim_Writer( void * ctx, const char * buf, size_t size )
+{
+    KDkim dkim = (KDkim)ctx;
+    dkim->size += size;
+
+    if( !dkim->in_body )
+    {
+        size_t i;
+        for( i = 0; i < size && dkim->eoh < 4; i++ )
+        {
+            if( buf[i] == ((dkim->eoh & 1) ? '\n' : '\r') ) dkim->eoh++;
+            else dkim->eoh = (buf[i] == '\r') ? 1 : 0;
+        }
+        if( !addHeaders( dkim, buf, i ) ) return 0;
+        if( dkim->eoh < 4 ) return 1;
+        dkim->in_body = 1;
+        buf += i;
+        size -= i;
+    }
+    return hashBody( dkim, buf, size );
+}
+
+/*
+ * RFC 6376, 3.4.2: relaxed header canonicalization.
+ */
+static int hashHeader( EVP_MD_CTX * hh, const char * h, size_t size,
+        int crlf )
+{
+    size_t i = 0;
+    size_t n = 0;
+    int wsp = 0;
+    int rc;
+    char * out = Malloc( size + 3 );
+    if( !out ) return 0;
+
+    while( i < size && h[i] != ':' )
+    {
+        if( h[i] != ' ' && h[i] != '\t' ) out[n++] = tolower(
+                (unsigned char)h[i] );
+        i++;
+    }
+    out[n++] = ':';
+    for( i++; i < size; i++ )
+    {
+        if( h[i] == '\r' || h[i] == '\n' ) continue;
+        if( h[i] == ' ' || h[i] == '\t' )
+        {
+            wsp = 1;
+            continue;
+        }
+        if( wsp && out[n - 1] != ':' ) out[n++] = ' ';
+        wsp = 0;
+        out[n++] = h[i];
+    }
+    if( crlf )
+    {
+        out[n++] = '\r';
+        out[n++] = '\n';
+    }
+    rc = EVP_DigestUpdate( hh, out, n );
+    Free( out );
+    return rc;
+}
+
+/*
+ * Next header field in [*ptr, end), with folded lines, without final CRLF.
+ */
+static const char * nextField( const char ** ptr, const char * end,
+        size_t * size )
+{
+    const char * start = *ptr;
+    const char * p = start;
+
+    if( p >= end || *p == '\r' || *p == '\n' ) return NULL;
+    for( ;; )
+    {
+        while( p < end && *p != '\n' )
+            p++;
+        if( p + 1 < end && (p[1] == ' ' || p[1] == '\t') )
+        {
+            p++;
+            continue;
+        }
+        break;
+    }
+    *size = p - start;
+    if( *size && start[*size - 1] == '\r' ) (*size)--;
+    *ptr = p < end ? p + 1 : end;
+    return start;
+}
+
+static int fieldIs( const char * field, size_t size, const char * name,
+        size_t nsize )
+{
+    if( size <= nsize || strncasecmp( field, name, nsize ) ) return 0;
+    field += nsize;
+    while( *field == ' ' || *field == '\t' )
+        field++;
+    return *field == ':';
+}
+
+/*
+ * Hash signed headers (bottom-up instance selection), collect h= value.
+ */
+static int hashHeaders( KDkim dkim, EVP_MD_CTX * hh, string hlist )
+{
+    const char * end = dkim->hdrs + dkim->hdrs_size;
+    const char * name = dkim->sign_headers;
+    char * used;
+    size_t count = 0;
+    int rc = 1;
+
+    used = Calloc( dkim->hdrs_size + 1, 1 );
+    if( !used ) return 0;
+
+    while( rc && *name )
+    {
+        size_t nsize = strcspn( name, ":" );
+        const char * ptr = dkim->hdrs;
+        const char * field;
+        const char * found = NULL;
+        size_t size, fsize = 0;
+
+        while( (field = nextField( &ptr, end, &size )) )
+        {
+            if( !used[field - dkim->hdrs]
+                    && fieldIs( field, size, name, nsize ) )
+            {
+                found = field;
+                fsize = size;
+            }
+        }
+        if( found )
+        {
+            char hname[64];
+            snprintf( hname, sizeof(hname), "%.*s", (int)nsize, name );
+            used[found - dkim->hdrs] = 1;
+            rc = hashHeader( hh, found, fsize, 1 )
+                    && xscatc( hlist, count++ ? ":" : "", hname, NULL );
+        }
+        name += nsize;
+        if( *name ) name++;
+    }
+    Free( used );
+    return rc;
+}
+
+static int signDigest( KDkim dkim, const unsigned char * digest,
+        size_t dsize, unsigned char * sig, size_t * ssize )
+{
+    int rc = 0;
+
+    if( EVP_PKEY_id( dkim->key ) == EVP_PKEY_ED25519 )
+    {
+        /*
+         * RFC 8463: Ed25519 signs the SHA-256 hash of the header data.
+         */
+        EVP_MD_CTX * mctx = EVP_MD_CTX_new();
+        if( !mctx ) return 0;
+        rc = EVP_DigestSignInit( mctx, NULL, NULL, NULL, dkim->key ) > 0
+                && EVP_DigestSign( mctx, sig, ssize, digest, dsize ) > 0;
+        EVP_MD_CTX_free( mctx );
+    }
+    else
+    {
+        EVP_PKEY_CTX * pctx = EVP_PKEY_CTX_new( dkim->key, NULL );
+        if( !pctx ) return 0;
+        rc = EVP_PKEY_sign_init( pctx ) > 0
+                && EVP_PKEY_CTX_set_rsa_padding( pctx, RSA_PKCS1_PADDING ) > 0
+                && EVP_PKEY_CTX_set_signature_md( pctx, EVP_sha256() ) > 0
+                && EVP_PKEY_sign( pctx, sig, ssize, digest, dsize ) > 0;
+        EVP_PKEY_CTX_free( pctx );
+    }
+    return rc;
+}
+
+static int foldB64( string out, const unsigned char * buf, size_t size )
+{
+    string b64 = base64_encode( (const char *)buf, size );
+    const char * ptr;
+    size_t left;
+    if( !b64 ) return 0;
+
+    ptr = sstr( b64 );
+    left = slen( b64 );
+    while( left )
+    {
+        char line[DKIM_FOLD_SIZE + 1];
+        size_t chunk = left > DKIM_FOLD_SIZE ? DKIM_FOLD_SIZE : left;
+        memcpy( line, ptr, chunk );
+        line[chunk] = 0;
+        ptr += chunk;
+        left -= chunk;
+        if( !xscatc( out, line, left ? "\r\n\t" : "\r\n", NULL ) )
+        {
+            sdel( b64 );
+            return 0;
+        }
+    }
+    sdel( b64 );
+    return 1;
+}
+
+string dkim_Sign( KDkim dkim, string error )
+{
+    unsigned char bh[EVP_MAX_MD_SIZE];
+    unsigned char hh[EVP_MAX_MD_SIZE];
+    unsigned char * sig = NULL;
+    unsigned int bh_size, hh_size;
+    size_t sig_size = 0;
+    string bh64 = NULL;
+    string hlist = snew();
+    string out = snew();
+    EVP_MD_CTX * hctx = EVP_MD_CTX_new();
+    int ed25519 = EVP_PKEY_id( dkim->key ) == EVP_PKEY_ED25519;
+
+    if( !hlist || !out || !hctx ) goto serror;
+
+    /* a bare CR at the very end can not start a line break any more */
+    dkim->cr = 0;
+    if( dkim->content && !EVP_DigestUpdate( dkim->bh, "\r\n", 2 ) ) goto serror;
+    if( !EVP_DigestFinal_ex( dkim->bh, bh, &bh_size ) ) goto serror;
+    bh64 = base64_encode( (const char *)bh, bh_size );
+    if( !bh64 ) goto serror;
+
+    if( !EVP_DigestInit_ex( hctx, EVP_sha256(), NULL )
+            || !hashHeaders( dkim, hctx, hlist ) ) goto serror;
+
+    if( !sprint( out, "DKIM-Signature: v=1; a=%s; c=relaxed/relaxed;"
+            " d=%s; s=%s;\r\n\tt=%ld; bh=%s;\r\n\th=%s;\r\n\tb=",
+            ed25519 ? "ed25519-sha256" : "rsa-sha256", dkim->domain,
+            dkim->selector, (long)time( NULL ), sstr( bh64 ), sstr( hlist ) ) )
+        goto serror;
+
+    if( !hashHeader( hctx, sstr( out ), slen( out ), 0 )
+            || !EVP_DigestFinal_ex( hctx, hh, &hh_size ) ) goto serror;
+
+    sig_size = EVP_PKEY_size( dkim->key );
+    sig = Malloc( sig_size );
+    if( !sig || !signDigest( dkim, hh, hh_size, sig, &sig_size )
+            || !foldB64( out, sig, sig_size ) ) goto serror;
+
+    Free( sig );
+    sdel( bh64 );
+    sdel( hlist );
+    EVP_MD_CTX_free( hctx );
+    return out;
+
+    serror: scpyc( error, "dkim_Sign(), internal error" );
+    Free( sig );
+    sdel( bh64 );
+    sdel( hlist );
+    sdel( out );
+    EVP_MD_CTX_free( hctx );
+    return NULL;
+}
+
+int dkim_SignPrepared( KDkim dkim, KPrepared prep, string error )
+{
+    string sig;
+
+    if( !dkim_Begin( dkim ) || !dkim_Writer( dkim, prep->data, prep->size ) )
+    {
+        scpyc( error, "dkim_SignPrepared(), internal error [1]" );
+        return 0;
+    }
+    sig = dkim_Sign( dkim, error );
+    if( !sig ) return 0;
+
+    if( prep->size + slen( sig ) > prep->bsize )
+    {
+        char * data = Realloc( prep->data, prep->size + slen( sig ) );
+        if( !data )
+        {
+            sdel( sig );
+            scpyc( error, "dkim_SignPrepared(), internal error [2]" );
+            return 0;
+        }
+        prep->data = data;
+        prep->bsize = prep->size + slen( sig );
+    }
+    memmove( prep->data + slen( sig ), prep->data, prep->size );
+    memcpy( prep->data, sstr( sig ), slen( sig ) );
+    prep->size += slen( sig );
+    prep->dkim = 1;
+    sdel( sig );
+    return 1;
+}
@@ -0,0 +1,57 @@
+/*
+ * dkim.h, part of "ksmtp" project.
+ */
+
+#ifndef DKIM_H_
+#define DKIM_H_
+
+#include "kmsg.h"
+#include <openssl/evp.h>
+
+#define DKIM_DEFAULT_HEADERS "From:Reply-To:To:Cc:Subject:Date:Message-ID:MIME-Version:Content-Type"
+
+/*
+ * Signer with relaxed/relaxed canonicalization, rsa-sha256 or ed25519-sha256
+ * (selected by the private key type).
+ */
+typedef struct _KDkim
+{
+    char * domain;
+    char * selector;
+    char * sign_headers;
+    EVP_PKEY * key;
+
+    /*
+     * Per-message state: dkim_Writer() collects the header block and hashes
+     * the canonicalized body, nothing else is stored.
+     */
+    EVP_MD_CTX * bh;
+    char * hdrs;
+    size_t hdrs_size;
+    size_t hdrs_bsize;
+    size_t size;
+    int in_body;
+    int eoh;
+    int cr;
+    int wsp;
+    size_t crlf;
+    int content;
+}*KDkim;
+
+KDkim dkim_Create( const char * domain, const char * selector,
+        const char * keyfile, string error );
+void dkim_Destroy( KDkim dkim );
+
+int dkim_SetHeaders( KDkim dkim, const char * headers );
+
+int dkim_Begin( KDkim dkim );
+int dkim_Writer( void * ctx, const char * buf, size_t size );
+string dkim_Sign( KDkim dkim, string error );
+
+/*
+ * Puts a DKIM-Signature in front of the prepared data. Each call adds one,
+ * mail_SendPrepared() calls it for a message that has none.
+ */
+int dkim_SignPrepared( KDkim dkim, KPrepared prep, string error );
+
+#endif /* DKIM_H_ */
@@ -0,0 +1,42 @@
+/*
+ * kbuf.c, part of "ksmtp" project.
+ */
+
+#include "kbuf.h"
+
+KBuffer kbuf_Create( const void * data, size_t size )
+{
+    KBuffer buf;
+    char * copy = Malloc( size + 1 );
+    if( !copy ) return NULL;
+    memcpy( copy, data, size );
+    copy[size] = 0;
+    buf = kbuf_Own( copy, size );
+    if( !buf ) Free( copy );
+    return buf;
+}
+
+KBuffer kbuf_Own( void * data, size_t size )
+{
+    KBuffer buf = Malloc( sizeof(struct _KBuffer) );
+    if( !buf ) return NULL;
+    buf->data = data;
+    buf->size = size;
+    buf->refs = 1;
+    return buf;
+}
+
+KBuffer kbuf_Ref( KBuffer buf )
+{
+    __sync_add_and_fetch( &buf->refs, 1 );
+    return buf;
+}
+
+void kbuf_Unref( KBuffer buf )
+{
+    if( buf && !__sync_sub_and_fetch( &buf->refs, 1 ) )
+    {
+        Free( buf->data );
+        Free( buf );
+    }
+}
@@ -0,0 +1,26 @@
+/*
+ * kbuf.h, part of "ksmtp" project.
+ */
+
+#ifndef KBUF_H_
+#define KBUF_H_
+
+#include "../klib/config.h"
+
+/*
+ * Immutable reference-counted buffer, may be shared by many messages and
+ * threads. The last kbuf_Unref() frees it.
+ */
+typedef struct _KBuffer
+{
+    char * data;
+    size_t size;
+    volatile size_t refs;
+}*KBuffer;
+
+KBuffer kbuf_Create( const void * data, size_t size );
+KBuffer kbuf_Own( void * data, size_t size );
+KBuffer kbuf_Ref( KBuffer buf );
+void kbuf_Unref( KBuffer buf );
+
+#endif /* KBUF_H_ */
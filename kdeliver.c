@@ -0,0 +1,349 @@
+/*
+ * kdeliver.c, part of "ksmtp" project.
+ */
+
+#include "kdeliver.h"
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+/*
+ * What the engine keeps about a queued message: the memory reserved for
+ * it by admission control, its lane and when it was queued (monotonic
+ * microseconds). The message itself is left as the caller built it.
+ */
+typedef struct _DeliverItem
+{
+    KMsg msg;
+    size_t admitted;
+    DeliverLane lane;
+    unsigned long long queued;
+} DeliverItem;
+
+static unsigned long long nowUs( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (unsigned long long)ts.tv_sec * 1000000ULL
+            + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+static void laneWaited( DeliverQueue * lane, DeliverItem * item )
+{
+    unsigned long long wait = nowUs() - item->queued;
+    unsigned long long max = __atomic_load_n( &lane->stat.wait_max,
+            __ATOMIC_RELAXED );
+
+    __sync_add_and_fetch( &lane->stat.waited, 1 );
+    __sync_add_and_fetch( &lane->stat.wait_total, wait );
+    __atomic_store_n( &lane->stat.wait_last, wait, __ATOMIC_RELAXED );
+    while( wait > max )
+    {
+        if( __sync_bool_compare_and_swap( &lane->stat.wait_max, max, wait ) ) break;
+        max = __atomic_load_n( &lane->stat.wait_max, __ATOMIC_RELAXED );
+    }
+}
+
+static DeliverItem * popLane( KDeliver deliver, int lane )
+{
+    DeliverItem * item = kqueue_Pop( deliver->lanes[lane].queue );
+    if( item ) laneWaited( &deliver->lanes[lane], item );
+    return item;
+}
+
+static size_t lanesPending( KDeliver deliver, int urgent_only )
+{
+    size_t i, size = 0;
+
+    if( urgent_only ) return kqueue_Size( deliver->lanes[DELIVER_URGENT].queue );
+    for( i = 0; i < DELIVER_LANES; i++ )
+        size += kqueue_Size( deliver->lanes[i].queue );
+    return size;
+}
+
+/*
+ * Weighted round robin by a shared tick, without a lock: the tick picks
+ * the first lane to try, an empty lane gives its turn to the next one.
+ */
+static DeliverItem * deliverPick( KDeliver deliver, int urgent_only )
+{
+    unsigned total = 0;
+    int i, first = 0;
+
+    if( urgent_only ) return popLane( deliver, DELIVER_URGENT );
+    for( i = 0; i < DELIVER_LANES; i++ )
+        total += deliver->lanes[i].weight;
+    if( total )
+    {
+        unsigned t = (unsigned)(__sync_fetch_and_add( &deliver->tick, 1 )
+                % total);
+        for( ; first < DELIVER_LANES - 1; first++ )
+        {
+            if( t < deliver->lanes[first].weight ) break;
+            t -= deliver->lanes[first].weight;
+        }
+    }
+    for( i = 0; i < DELIVER_LANES; i++ )
+    {
+        DeliverItem * item = popLane( deliver, (first + i) % DELIVER_LANES );
+        if( item ) return item;
+    }
+    return NULL;
+}
+
+static void deliverOne( DeliverWorker * w, DeliverItem * item )
+{
+    KDeliver deliver = w->deliver;
+    KMsg msg = item->msg;
+    DeliverQueue * lane = &deliver->lanes[item->lane];
+    int rc;
+
+    if( !w->open )
+    {
+        w->open = mail_OpenSession( w->mail, deliver->tls, deliver->auth );
+        if( !w->open ) mail_CloseSession( w->mail );
+    }
+    rc = w->open && mail_SendMessage( w->mail, msg );
+    if( !rc && w->open && mail_Broken( w->mail ) )
+    {
+        mail_CloseSession( w->mail );
+        w->open = 0;
+    }
+
+    __sync_add_and_fetch( rc ? &deliver->sent : &deliver->failed, 1 );
+    __sync_add_and_fetch( rc ? &lane->stat.sent : &lane->stat.failed, 1 );
+    if( deliver->done ) deliver->done( deliver->done_ctx, msg, rc,
+            rc ? NULL : mail_GetError( w->mail ) );
+    __sync_sub_and_fetch( &deliver->reserved, item->admitted );
+    msg_Destroy( msg );
+    Free( item );
+}
+
+/*
+ * Every queued message posts 'ready' once, so a worker holding a token
+ * knows that a message is (or is about to be) in a queue. Urgent messages
+ * also post 'urgent' for the reserved workers; the token left over finds
+ * nothing to pick and is dropped. Lanes are chosen by the semaphore the
+ * token came from, so changing the reserve never loses a message.
+ */
+static void * deliverWorker( void * arg )
+{
+    DeliverWorker * w = (DeliverWorker *)arg;
+    KDeliver deliver = w->deliver;
+    size_t idx = (size_t)(w - deliver->workers);
+
+    for( ;; )
+    {
+        DeliverItem * item;
+        struct timespec ts;
+        int urgent_only = idx < __atomic_load_n( &deliver->reserve,
+                __ATOMIC_RELAXED );
+
+        clock_gettime( CLOCK_REALTIME, &ts );
+        ts.tv_sec += KDELIVER_IDLE;
+        if( sem_timedwait( urgent_only ? &deliver->urgent : &deliver->ready,
+                &ts ) )
+        {
+            if( errno == ETIMEDOUT && w->open )
+            {
+                mail_CloseSession( w->mail );
+                w->open = 0;
+            }
+            continue;
+        }
+
+        while( !(item = deliverPick( deliver, urgent_only )) )
+        {
+            if( !lanesPending( deliver, urgent_only ) ) break;
+            sched_yield();
+        }
+        if( item ) deliverOne( w, item );
+        else if( deliver->stop ) break;
+    }
+
+    if( w->open ) mail_CloseSession( w->mail );
+    w->open = 0;
+    return NULL;
+}
+
+KDeliver deliver_Create( size_t qsize, size_t workers, MailFactory factory,
+        void * ctx, int tls, AuthType auth )
+{
+    size_t i;
+    KDeliver deliver = Calloc( sizeof(struct _KDeliver), 1 );
+    if( !deliver ) return NULL;
+
+    for( i = 0; i < DELIVER_LANES; i++ )
+    {
+        deliver->lanes[i].queue = kqueue_Create( qsize );
+        if( !deliver->lanes[i].queue ) goto pmerror;
+    }
+    deliver->lanes[DELIVER_URGENT].weight = KDELIVER_URGENT_WEIGHT;
+    deliver->lanes[DELIVER_NORMAL].weight = KDELIVER_NORMAL_WEIGHT;
+    deliver->tls_cache = tlscache_Create();
+    if( !deliver->tls_cache || sem_init( &deliver->ready, 0, 0 ) ) goto pmerror;
+    if( sem_init( &deliver->urgent, 0, 0 ) )
+    {
+        sem_destroy( &deliver->ready );
+        goto pmerror;
+    }
+    deliver->tls = tls;
+    deliver->auth = auth;
+
+    if( workers > KDELIVER_MAX_WORKERS ) workers = KDELIVER_MAX_WORKERS;
+    if( !workers ) workers = 1;
+    for( i = 0; i < workers; i++ )
+    {
+        DeliverWorker * w = &deliver->workers[i];
+        w->deliver = deliver;
+        w->mail = factory( ctx );
+        if( !w->mail ) break;
+        mail_SetTlsCache( w->mail, deliver->tls_cache );
+        if( pthread_create( &w->thread, NULL, deliverWorker, w ) )
+        {
+            mail_Destroy( w->mail );
+            break;
+        }
+        deliver->nworkers++;
+    }
+    if( deliver->nworkers < workers )
+    {
+        deliver_Destroy( deliver );
+        return NULL;
+    }
+    return deliver;
+
+    pmerror: tlscache_Unref( deliver->tls_cache );
+    for( i = 0; i < DELIVER_LANES; i++ )
+        kqueue_Destroy( deliver->lanes[i].queue );
+    Free( deliver );
+    return NULL;
+}
+
+void deliver_SetDone( KDeliver deliver, DeliverDone done, void * ctx )
+{
+    deliver->done = done;
+    deliver->done_ctx = ctx;
+}
+
+void deliver_SetBudget( KDeliver deliver, size_t bytes )
+{
+    deliver->budget = bytes;
+}
+
+void deliver_SetReserve( KDeliver deliver, size_t workers )
+{
+    if( workers >= deliver->nworkers ) workers = deliver->nworkers - 1;
+    __atomic_store_n( &deliver->reserve, workers, __ATOMIC_RELAXED );
+}
+
+void deliver_SetWeight( KDeliver deliver, DeliverLane lane, unsigned weight )
+{
+    if( lane < DELIVER_LANES ) deliver->lanes[lane].weight = weight;
+}
+
+int deliver_SubmitLane( KDeliver deliver, KMsg msg, DeliverLane lane )
+{
+    DeliverQueue * q;
+    DeliverItem * item;
+    size_t need = deliver->budget ? msg_Footprint( msg ) : 0;
+
+    if( lane >= DELIVER_LANES ) lane = DELIVER_NORMAL;
+    q = &deliver->lanes[lane];
+    if( need )
+    {
+        size_t limit = deliver->budget;
+        size_t reserved = __sync_add_and_fetch( &deliver->reserved, need );
+        if( lane != DELIVER_URGENT ) limit -= limit / KDELIVER_URGENT_HEADROOM;
+        if( reserved > limit && reserved != need )
+        {
+            __sync_sub_and_fetch( &deliver->reserved, need );
+            __sync_add_and_fetch( &deliver->rejected, 1 );
+            __sync_add_and_fetch( &q->stat.rejected, 1 );
+            return 0;
+        }
+    }
+    item = Malloc( sizeof(DeliverItem) );
+    if( item )
+    {
+        item->msg = msg;
+        item->admitted = need;
+        item->lane = lane;
+        item->queued = nowUs();
+    }
+    if( !item || deliver->stop || !kqueue_Push( q->queue, item ) )
+    {
+        __sync_sub_and_fetch( &deliver->reserved, need );
+        Free( item );
+        __sync_add_and_fetch( &deliver->rejected, 1 );
+        __sync_add_and_fetch( &q->stat.rejected, 1 );
+        return 0;
+    }
+    __sync_add_and_fetch( &deliver->submitted, 1 );
+    __sync_add_and_fetch( &q->stat.submitted, 1 );
+    if( lane == DELIVER_URGENT
+            && __atomic_load_n( &deliver->reserve, __ATOMIC_RELAXED ) )
+    {
+        sem_post( &deliver->urgent );
+    }
+    sem_post( &deliver->ready );
+    return 1;
+}
+
+size_t deliver_Pending( KDeliver deliver )
+{
+    return lanesPending( deliver, 0 );
+}
+
+void deliver_GetLaneStat( KDeliver deliver, DeliverLane lane,
+        DeliverLaneStat * out )
+{
+    DeliverLaneStat * stat = &deliver->lanes[lane].stat;
+
+    out->submitted = __atomic_load_n( &stat->submitted, __ATOMIC_RELAXED );
+    out->rejected = __atomic_load_n( &stat->rejected, __ATOMIC_RELAXED );
+    out->sent = __atomic_load_n( &stat->sent, __ATOMIC_RELAXED );
+    out->failed = __atomic_load_n( &stat->failed, __ATOMIC_RELAXED );
+    out->waited = __atomic_load_n( &stat->waited, __ATOMIC_RELAXED );
+    out->wait_total = __atomic_load_n( &stat->wait_total, __ATOMIC_RELAXED );
+    out->wait_max = __atomic_load_n( &stat->wait_max, __ATOMIC_RELAXED );
+    out->wait_last = __atomic_load_n( &stat->wait_last, __ATOMIC_RELAXED );
+    out->pending = kqueue_Size( deliver->lanes[lane].queue );
+}
+
+void deliver_Destroy( KDeliver deliver )
+{
+    size_t i;
+    DeliverItem * item;
+
+    if( !deliver ) return;
+    deliver->stop = 1;
+    __sync_synchronize();
+    for( i = 0; i < deliver->nworkers; i++ )
+    {
+        sem_post( &deliver->ready );
+        sem_post( &deliver->urgent );
+    }
+    for( i = 0; i < deliver->nworkers; i++ )
+    {
+        pthread_join( deliver->workers[i].thread, NULL );
+        mail_Destroy( deliver->workers[i].mail );
+    }
+
+    while( (item = deliverPick( deliver, 0 )) )
+    {
+        deliver->failed++;
+        deliver->lanes[item->lane].stat.failed++;
+        if( deliver->done ) deliver->done( deliver->done_ctx, item->msg, 0,
+                "Delivery engine stopped" );
+        deliver->reserved -= item->admitted;
+        msg_Destroy( item->msg );
+        Free( item );
+    }
+    sem_destroy( &deliver->ready );
+    sem_destroy( &deliver->urgent );
+    tlscache_Unref( deliver->tls_cache );
+    for( i = 0; i < DELIVER_LANES; i++ )
+        kqueue_Destroy( deliver->lanes[i].queue );
+    Free( deliver );
+}
@@ -0,0 +1,142 @@
+/*
+ * kdeliver.h, part of "ksmtp" project.
+ */
+
+#ifndef KDELIVER_H_
+#define KDELIVER_H_
+
+#include "kmail.h"
+#include "kqueue.h"
+#include <pthread.h>
+#include <semaphore.h>
+
+#define KDELIVER_MAX_WORKERS    64
+/*
+ * Seconds before an idle worker closes its SMTP session.
+ */
+#define KDELIVER_IDLE           30
+/*
+ * Default lane weights: with both lanes busy an urgent message is taken 8
+ * times out of 9.
+ */
+#define KDELIVER_URGENT_WEIGHT  8
+#define KDELIVER_NORMAL_WEIGHT  1
+/*
+ * Part of the memory budget (1/N) only urgent messages may use.
+ */
+#define KDELIVER_URGENT_HEADROOM 8
+
+typedef enum _DeliverLane
+{
+    DELIVER_URGENT = 0, DELIVER_NORMAL, DELIVER_LANES
+} DeliverLane;
+
+/*
+ * Creates a configured KMail (host, login, DKIM...) for one worker.
+ */
+typedef KMail (*MailFactory)( void * ctx );
+
+/*
+ * Called from a worker thread after each delivery, before the message is
+ * destroyed. 'error' is NULL on success.
+ */
+typedef void (*DeliverDone)( void * ctx, KMsg msg, int rc,
+        const char * error );
+
+typedef struct _DeliverWorker
+{
+    struct _KDeliver * deliver;
+    KMail mail;
+    int open;
+    pthread_t thread;
+} DeliverWorker;
+
+/*
+ * Lane counters; queue latency (submit to pick up) is in microseconds,
+ * 'waited' messages were picked up.
+ */
+typedef struct _DeliverLaneStat
+{
+    size_t submitted;
+    size_t rejected;
+    size_t sent;
+    size_t failed;
+    size_t pending;
+    size_t waited;
+    unsigned long long wait_total;
+    unsigned long long wait_max;
+    unsigned long long wait_last;
+} DeliverLaneStat;
+
+typedef struct _DeliverQueue
+{
+    KQueue queue;
+    unsigned weight;
+    DeliverLaneStat stat;
+} DeliverQueue;
+
+/*
+ * Delivery engine: application threads hand built messages over to
+ * lock-free lane queues, worker threads with their own sessions send them.
+ * A worker picks a lane for every transaction (weighted round robin over
+ * non-empty lanes), so urgent mail goes out on the next free session
+ * instead of behind a bulk backlog. The first 'reserve' workers take urgent
+ * messages only.
+ */
+typedef struct _KDeliver
+{
+    DeliverQueue lanes[DELIVER_LANES];
+    KTlsCache tls_cache;
+    sem_t ready;
+    sem_t urgent;
+    size_t tick;
+    size_t reserve;
+    int tls;
+    AuthType auth;
+    DeliverDone done;
+    void * done_ctx;
+    volatile int stop;
+    size_t nworkers;
+    DeliverWorker workers[KDELIVER_MAX_WORKERS];
+    size_t budget;
+    size_t reserved;
+
+    size_t submitted;
+    size_t rejected;
+    size_t sent;
+    size_t failed;
+}*KDeliver;
+
+KDeliver deliver_Create( size_t qsize, size_t workers, MailFactory factory,
+        void * ctx, int tls, AuthType auth );
+void deliver_SetDone( KDeliver deliver, DeliverDone done, void * ctx );
+/*
+ * Admission control: queued and in-flight messages may hold at most
+ * 'bytes' (msg_Footprint()), 0 - no limit. A single message is always
+ * admitted into an empty engine.
+ */
+void deliver_SetBudget( KDeliver deliver, size_t bytes );
+/*
+ * 'workers' sessions (fewer than all) serve the urgent lane only.
+ */
+void deliver_SetReserve( KDeliver deliver, size_t workers );
+void deliver_SetWeight( KDeliver deliver, DeliverLane lane, unsigned weight );
+/*
+ * Never blocks. Returns 1 if the message was queued (the engine owns it
+ * from now on), 0 if the queue or the memory budget is full (the caller
+ * still owns it). The normal lane may fill the budget up to the urgent
+ * headroom only.
+ */
+int deliver_SubmitLane( KDeliver deliver, KMsg msg, DeliverLane lane );
+#define deliver_Submit( deliver, msg ) \
+    deliver_SubmitLane( (deliver), (msg), DELIVER_NORMAL )
+/*
+ * Delivers everything already queued, stops workers and frees the engine.
+ */
+void deliver_Destroy( KDeliver deliver );
+
+size_t deliver_Pending( KDeliver deliver );
+void deliver_GetLaneStat( KDeliver deliver, DeliverLane lane,
+        DeliverLaneStat * out );
+
+#endif /* KDELIVER_H_ */
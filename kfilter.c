@@ -0,0 +1,146 @@
+/*
+ * kfilter.c, part of "ksmtp" project.
+ */
+
+#include "kfilter.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * First CR or LF in [p, end), 'end' if there is none. SSE2 compares 16
+ * bytes at a time, the scalar loop does the tail (and everything on other
+ * targets).
+ */
+static const char * findEol( const char * p, const char * end )
+{
+#ifdef __SSE2__
+    const __m128i lf = _mm_set1_epi8( '\n' );
+    const __m128i cr = _mm_set1_epi8( '\r' );
+
+    while( end - p >= 16 )
+    {
+        __m128i v = _mm_loadu_si128( (const __m128i *)p );
+        int mask = _mm_movemask_epi8(
+                _mm_or_si128( _mm_cmpeq_epi8( v, lf ), _mm_cmpeq_epi8( v, cr ) ) );
+        if( mask ) return p + __builtin_ctz( mask );
+        p += 16;
+    }
+#endif
+    while( p < end && *p != '\n' && *p != '\r' )
+        p++;
+    return p;
+}
+
+static int emit( DataFilter * f, const char * buf, size_t size )
+{
+    if( !size ) return 1;
+    f->size += size;
+    return f->writer( f->ctx, buf, size );
+}
+
+void filter_Init( DataFilter * f, int mode, FilterWriter writer, void * ctx )
+{
+    memset( f, 0, sizeof(DataFilter) );
+    f->writer = writer;
+    f->ctx = ctx;
+    f->mode = mode;
+    f->bol = 1;
+}
+
+int filter_Write( void * ctx, const char * buf, size_t size )
+{
+    DataFilter * f = (DataFilter *)ctx;
+    const char * p = buf;
+    const char * end = buf + size;
+    const char * run = buf;
+
+    if( !size ) return 1;
+    if( f->cr )
+    {
+        /*
+         * CR held back at the end of the previous buffer.
+         */
+        f->cr = 0;
+        if( *p == '\n' ) p++;
+        if( !emit( f, "\r\n", 2 ) ) return 0;
+        run = p;
+        f->bol = 1;
+        f->col = 0;
+    }
+
+    while( p < end )
+    {
+        const char * e;
+        const char * limit = end;
+        size_t room = (size_t)-1;
+
+        if( f->bol )
+        {
+            f->bol = 0;
+            if( *p == '.' && (f->mode & FILTER_DOTS) )
+            {
+                if( !emit( f, run, p - run ) || !emit( f, ".", 1 ) ) return 0;
+                run = p;
+            }
+        }
+        if( f->mode & FILTER_LIMIT )
+        {
+            room = FILTER_MAX_LINE - f->col;
+            if( (size_t)(end - p) > room ) limit = p + room + 1;
+        }
+
+        e = findEol( p, limit );
+        if( e == limit )
+        {
+            if( limit == end && (size_t)(end - p) <= room )
+            {
+                f->col += end - p;
+                break;
+            }
+            e = p + room;
+            if( !emit( f, run, e - run ) || !emit( f, "\r\n", 2 ) ) return 0;
+            run = p = e;
+        }
+        else if( !(f->mode & FILTER_CRLF) )
+        {
+            if( *e == '\r' )
+            {
+                f->col += e + 1 - p;
+                p = e + 1;
+                continue;
+            }
+            p = e + 1;
+        }
+        else if( *e == '\r' && e + 1 == end )
+        {
+            f->cr = 1;
+            return emit( f, run, e - run );
+        }
+        else if( *e == '\r' && e[1] == '\n' )
+        {
+            p = e + 2;
+        }
+        else
+        {
+            if( !emit( f, run, e - run ) || !emit( f, "\r\n", 2 ) ) return 0;
+            run = p = e + 1;
+        }
+        f->col = 0;
+        f->bol = 1;
+    }
+    return emit( f, run, end - run );
+}
+
+int filter_End( DataFilter * f )
+{
+    if( !(f->mode & FILTER_CRLF) ) return 1;
+    if( f->cr || f->col || !f->bol )
+    {
+        f->cr = 0;
+        f->col = 0;
+        f->bol = 1;
+        return emit( f, "\r\n", 2 );
+    }
+    return 1;
+}
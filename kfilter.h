@@ -0,0 +1,48 @@
+/*
+ * kfilter.h, part of "ksmtp" project.
+ */
+
+#ifndef KFILTER_H_
+#define KFILTER_H_
+
+#include "../klib/config.h"
+
+/*
+ * RFC 5321 4.5.3.1.6: 1000 octets with CRLF.
+ */
+#define FILTER_MAX_LINE     998
+
+#define FILTER_CRLF         0x01
+#define FILTER_DOTS         0x02
+#define FILTER_LIMIT        0x04
+#define FILTER_DATA         (FILTER_CRLF | FILTER_DOTS | FILTER_LIMIT)
+
+/*
+ * Same signature as MsgWriter.
+ */
+typedef int (*FilterWriter)( void * ctx, const char * buf, size_t size );
+
+/*
+ * Output stage for DATA: bare LF and CR become CRLF, lines starting with
+ * '.' are dot-stuffed, lines over FILTER_MAX_LINE are broken. Clean runs
+ * are passed to the writer as they are, without copying.
+ */
+typedef struct _DataFilter
+{
+    FilterWriter writer;
+    void * ctx;
+    int mode;
+    int cr;
+    int bol;
+    size_t col;
+    size_t size;
+} DataFilter;
+
+void filter_Init( DataFilter * f, int mode, FilterWriter writer, void * ctx );
+int filter_Write( void * ctx, const char * buf, size_t size );
+/*
+ * Completes the last line.
+ */
+int filter_End( DataFilter * f );
+
+#endif /* KFILTER_H_ */
@@ -0,0 +1,280 @@
+/*
+ * kio.c, part of "ksmtp" project.
+ */
+
+#include "kio.h"
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef KSMTP_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#define SLOT( r, idx )      ((r)->buf + (idx) * KIO_CHUNK_SIZE)
+
+#ifdef KSMTP_URING
+
+static void ringClose( KIoRing * ring )
+{
+    if( ring->sqes ) munmap( ring->sqes, ring->sqes_size );
+    if( ring->cq_ptr && ring->cq_ptr != ring->sq_ptr )
+    {
+        munmap( ring->cq_ptr, ring->cq_size );
+    }
+    if( ring->sq_ptr ) munmap( ring->sq_ptr, ring->sq_size );
+    if( ring->fd >= 0 ) close( ring->fd );
+    memset( ring, 0, sizeof(KIoRing) );
+    ring->fd = -1;
+}
+
+static int ringOpen( KIoRing * ring, char * buf )
+{
+    struct io_uring_params p;
+    struct iovec iov[KIO_DEPTH];
+    size_t i;
+
+    memset( ring, 0, sizeof(KIoRing) );
+    memset( &p, 0, sizeof(p) );
+    ring->fd = (int)syscall( __NR_io_uring_setup, KIO_DEPTH, &p );
+    if( ring->fd < 0 ) return 0;
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes
+            + p.cq_entries * sizeof(struct io_uring_cqe);
+    if( p.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        if( ring->cq_size > ring->sq_size ) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap( NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING );
+    if( ring->sq_ptr == MAP_FAILED )
+    {
+        ring->sq_ptr = NULL;
+        goto pmerror;
+    }
+    if( p.features & IORING_FEAT_SINGLE_MMAP ) ring->cq_ptr = ring->sq_ptr;
+    else
+    {
+        ring->cq_ptr = mmap( NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING );
+        if( ring->cq_ptr == MAP_FAILED )
+        {
+            ring->cq_ptr = NULL;
+            goto pmerror;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+    if( ring->sqes == MAP_FAILED )
+    {
+        ring->sqes = NULL;
+        goto pmerror;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr
+            + p.cq_off.cqes);
+
+    /*
+     * Registered buffers are pinned once, the kernel does not map them on
+     * every read.
+     */
+    for( i = 0; i < KIO_DEPTH; i++ )
+    {
+        iov[i].iov_base = buf + i * KIO_CHUNK_SIZE;
+        iov[i].iov_len = KIO_CHUNK_SIZE;
+    }
+    if( syscall( __NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+            iov, KIO_DEPTH ) < 0 ) goto pmerror;
+    return 1;
+
+    pmerror: ringClose( ring );
+    return 0;
+}
+
+static void ringRead( KReader r, size_t slot )
+{
+    KIoRing * ring = &r->ring;
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe * sqe = &ring->sqes[idx];
+
+    memset( sqe, 0, sizeof(struct io_uring_sqe) );
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = r->fd;
+    sqe->addr = (unsigned long)SLOT( r, slot );
+    sqe->len = KIO_CHUNK_SIZE;
+    sqe->off = (unsigned long long)r->offset;
+    sqe->buf_index = (unsigned short)slot;
+    sqe->user_data = slot;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n( ring->sq_tail, tail + 1, __ATOMIC_RELEASE );
+
+    r->offset += KIO_CHUNK_SIZE;
+    r->done[slot] = 0;
+    r->inflight++;
+}
+
+static int ringEnter( KReader r, unsigned submit, unsigned wait )
+{
+    int rc;
+    do
+    {
+        rc = (int)syscall( __NR_io_uring_enter, r->ring.fd, submit, wait,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+    } while( rc < 0 && errno == EINTR );
+    return rc >= 0;
+}
+
+static void ringReap( KReader r )
+{
+    KIoRing * ring = &r->ring;
+    unsigned head = *ring->cq_head;
+
+    while( head != __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE ) )
+    {
+        struct io_uring_cqe * cqe = &ring->cqes[head & *ring->cq_mask];
+        size_t slot = (size_t)cqe->user_data;
+        r->sizes[slot] = cqe->res;
+        r->done[slot] = 1;
+        r->inflight--;
+        head++;
+    }
+    __atomic_store_n( ring->cq_head, head, __ATOMIC_RELEASE );
+}
+
+/*
+ * Buffers stay pinned until every read has completed.
+ */
+static void ringDrain( KReader r )
+{
+    while( r->inflight )
+    {
+        ringReap( r );
+        if( r->inflight && !ringEnter( r, 0, 1 ) ) break;
+    }
+}
+
+static ssize_t ringNext( KReader r, const char ** buf )
+{
+    size_t slot = r->head;
+    ssize_t size;
+
+    if( r->returned >= 0 && !r->eof )
+    {
+        ringRead( r, (size_t)r->returned );
+        if( !ringEnter( r, 1, 0 ) ) return -1;
+    }
+    r->returned = -1;
+
+    for( ;; )
+    {
+        ringReap( r );
+        if( r->done[slot] ) break;
+        if( !ringEnter( r, 0, 1 ) ) return -1;
+    }
+    size = r->sizes[slot];
+    if( size < 0 )
+    {
+        errno = (int)-size;
+        return -1;
+    }
+    /*
+     * A short read is the end of a regular file: reads already queued
+     * behind it only find nothing.
+     */
+    if( size < KIO_CHUNK_SIZE ) r->eof = 1;
+    if( !size ) return 0;
+    r->returned = (int)slot;
+    r->head = (slot + 1) % KIO_DEPTH;
+    *buf = SLOT( r, slot );
+    return size;
+}
+
+#endif
+
+KReader kio_Open( const char * file )
+{
+    KReader r = Calloc( sizeof(struct _KReader), 1 );
+    if( !r ) return NULL;
+
+    r->returned = -1;
+    r->fd = open( file, O_RDONLY );
+    if( r->fd < 0 || posix_memalign( (void **)&r->buf, 4096,
+            KIO_DEPTH * KIO_CHUNK_SIZE ) )
+    {
+        int err = r->fd < 0 ? errno : ENOMEM;
+        if( r->fd >= 0 ) close( r->fd );
+        Free( r );
+        errno = err;
+        return NULL;
+    }
+    posix_fadvise( r->fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+#ifdef KSMTP_URING
+    if( ringOpen( &r->ring, r->buf ) )
+    {
+        size_t i;
+        r->uring = 1;
+        for( i = 0; i < KIO_DEPTH; i++ )
+            ringRead( r, i );
+        if( !ringEnter( r, KIO_DEPTH, 0 ) )
+        {
+            /*
+             * Nothing was submitted: the ring is just dropped.
+             */
+            ringClose( &r->ring );
+            r->uring = 0;
+            r->inflight = 0;
+            r->offset = 0;
+        }
+    }
+#endif
+    return r;
+}
+
+ssize_t kio_Read( KReader r, const char ** buf )
+{
+    ssize_t size;
+
+#ifdef KSMTP_URING
+    if( r->uring ) return ringNext( r, buf );
+#endif
+    if( r->eof ) return 0;
+    do
+    {
+        size = read( r->fd, r->buf, KIO_CHUNK_SIZE );
+    } while( size < 0 && errno == EINTR );
+    if( size <= 0 )
+    {
+        r->eof = 1;
+        return size;
+    }
+    *buf = r->buf;
+    return size;
+}
+
+void kio_Close( KReader r )
+{
+    if( !r ) return;
+#ifdef KSMTP_URING
+    if( r->uring )
+    {
+        ringDrain( r );
+        ringClose( &r->ring );
+    }
+#endif
+    close( r->fd );
+    free( r->buf );
+    Free( r );
+}
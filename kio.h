@@ -0,0 +1,72 @@
+/*
+ * kio.h, part of "ksmtp" project.
+ */
+
+#ifndef KIO_H_
+#define KIO_H_
+
+#include "../klib/config.h"
+#include <sys/types.h>
+
+#define KIO_CHUNK_SIZE      (64 * 1024)
+#define KIO_DEPTH           4
+
+#ifdef KSMTP_URING
+/*
+ * Minimal io_uring: one ring per reader, mapped by hand (no liburing).
+ */
+typedef struct _KIoRing
+{
+    int fd;
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+    void * sq_ptr;
+    size_t sq_size;
+    void * cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+} KIoRing;
+#endif
+
+/*
+ * Sequential file reader. Built with KSMTP_URING it keeps KIO_DEPTH reads
+ * into registered buffers in flight, so the disk works while the caller
+ * encodes and sends the previous chunk. Without it, or if the kernel has
+ * no io_uring (ENOSYS, EPERM...), it is a plain read() loop.
+ */
+typedef struct _KReader
+{
+    int fd;
+    char * buf;
+    off_t offset;
+    ssize_t sizes[KIO_DEPTH];
+    char done[KIO_DEPTH];
+    size_t head;
+    size_t inflight;
+    int returned;
+    int eof;
+    int uring;
+#ifdef KSMTP_URING
+    KIoRing ring;
+#endif
+}*KReader;
+
+KReader kio_Open( const char * file );
+/*
+ * Next chunk, valid until the next call: returns its size, 0 at the end
+ * of file, -1 on error (errno is set).
+ */
+ssize_t kio_Read( KReader r, const char ** buf );
+void kio_Close( KReader r );
+
+#define kio_Fd( r )     (r)->fd
+#define kio_Uring( r )  (r)->uring
+
+#endif /* KIO_H_ */
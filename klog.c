@@ -0,0 +1,134 @@
+/*
+ * klog.c, part of "ksmtp" project.
+ */
+
+#include "klog.h"
+#include <time.h>
+
+static void logEscaped( FILE * out, const char * s, size_t size )
+{
+    size_t i;
+
+    fputc( '"', out );
+    for( i = 0; i < size; i++ )
+    {
+        unsigned char c = (unsigned char)s[i];
+        if( c == '"' || c == '\\' ) fprintf( out, "\\%c", c );
+        else if( c == '\r' ) fputs( "\\r", out );
+        else if( c == '\n' ) fputs( "\\n", out );
+        else if( c == '\t' ) fputs( "\\t", out );
+        else if( c < 0x20 || c == 0x7f ) fprintf( out, "\\x%02x", c );
+        else fputc( c, out );
+    }
+    fputc( '"', out );
+}
+
+static void logRecord( KLog log, LogRecord rec )
+{
+    char date[32];
+    struct tm tm;
+    time_t sec = (time_t)rec->sec;
+
+    gmtime_r( &sec, &tm );
+    strftime( date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm );
+    fprintf( log->out, "%s.%03ldZ id=", date, rec->msec );
+    logEscaped( log->out, rec->id, strlen( rec->id ) );
+    fprintf( log->out, " phase=%s rc=%d size=%zu reply=", rec->phase,
+            rec->rc, rec->size );
+    logEscaped( log->out, rec->reply, strlen( rec->reply ) );
+    if( log->max_body )
+    {
+        fputs( " body=", log->out );
+        logEscaped( log->out, rec->body, rec->blen );
+    }
+    fputc( '\n', log->out );
+}
+
+static void * logWriter( void * arg )
+{
+    KLog log = (KLog)arg;
+    struct timespec pause = { 0, 10 * 1000000 };
+
+    for( ;; )
+    {
+        LogRecord rec = kqueue_Pop( log->queue );
+        if( rec )
+        {
+            logRecord( log, rec );
+            Free( rec );
+            log->written++;
+            continue;
+        }
+        fflush( log->out );
+        if( log->stop && !kqueue_Size( log->queue ) ) break;
+        nanosleep( &pause, NULL );
+    }
+    return NULL;
+}
+
+KLog klog_Create( FILE * out, size_t sample, size_t max_body )
+{
+    KLog log = Calloc( sizeof(struct _KLog), 1 );
+    if( !log ) return NULL;
+
+    log->queue = kqueue_Create( KLOG_QUEUE_SIZE );
+    log->out = out ? out : stderr;
+    log->sample = sample ? sample : 1;
+    log->max_body = max_body;
+    if( !log->queue || pthread_create( &log->thread, NULL, logWriter, log ) )
+    {
+        kqueue_Destroy( log->queue );
+        Free( log );
+        return NULL;
+    }
+    return log;
+}
+
+void klog_Destroy( KLog log )
+{
+    if( !log ) return;
+    log->stop = 1;
+    __sync_synchronize();
+    pthread_join( log->thread, NULL );
+    kqueue_Destroy( log->queue );
+    Free( log );
+}
+
+int klog_Sample( KLog log )
+{
+    return !(__sync_fetch_and_add( &log->seq, 1 ) % log->sample);
+}
+
+int klog_Write( KLog log, const char * id, const char * phase, int rc,
+        const char * reply, size_t size, const char * body, size_t blen )
+{
+    struct timespec ts;
+    LogRecord rec;
+
+    if( blen > log->max_body ) blen = log->max_body;
+    rec = Malloc( sizeof(struct _LogRecord) + blen );
+    if( !rec )
+    {
+        __sync_add_and_fetch( &log->dropped, 1 );
+        return 0;
+    }
+    clock_gettime( CLOCK_REALTIME, &ts );
+    rec->sec = (long)ts.tv_sec;
+    rec->msec = ts.tv_nsec / 1000000;
+    snprintf( rec->id, sizeof(rec->id), "%s", id ? id : "" );
+    rec->phase = phase;
+    rec->rc = rc;
+    snprintf( rec->reply, sizeof(rec->reply), "%s", reply ? reply : "" );
+    rec->size = size;
+    rec->blen = blen;
+    if( blen ) memcpy( rec->body, body, blen );
+    rec->body[blen] = 0;
+
+    if( !kqueue_Push( log->queue, rec ) )
+    {
+        Free( rec );
+        __sync_add_and_fetch( &log->dropped, 1 );
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,64 @@
+/*
+ * klog.h, part of "ksmtp" project.
+ */
+
+#ifndef KLOG_H_
+#define KLOG_H_
+
+#include "../klib/config.h"
+#include "kqueue.h"
+#include <pthread.h>
+#include <stdio.h>
+
+#define KLOG_QUEUE_SIZE     4096
+#define KLOG_MAX_BODY       4096
+
+/*
+ * One structured record: message id, SMTP phase, result and the server
+ * reply, the message size and its first 'blen' bytes.
+ */
+typedef struct _LogRecord
+{
+    long sec;
+    long msec;
+    char id[128];
+    const char * phase;
+    int rc;
+    char reply[256];
+    size_t size;
+    size_t blen;
+    char body[1];
+}*LogRecord;
+
+/*
+ * Asynchronous log: senders put records into a lock-free queue and never
+ * wait, a background thread formats and writes them. Records are dropped
+ * (and counted) when the queue is full.
+ */
+typedef struct _KLog
+{
+    KQueue queue;
+    FILE * out;
+    size_t sample;
+    size_t max_body;
+    size_t seq;
+    size_t written;
+    size_t dropped;
+    volatile int stop;
+    pthread_t thread;
+}*KLog;
+
+/*
+ * Every 'sample'-th message is logged (1 - all), bodies are truncated to
+ * 'max_body' bytes (0 - no bodies).
+ */
+KLog klog_Create( FILE * out, size_t sample, size_t max_body );
+/*
+ * Writes what is queued and stops the thread.
+ */
+void klog_Destroy( KLog log );
+int klog_Sample( KLog log );
+int klog_Write( KLog log, const char * id, const char * phase, int rc,
+        const char * reply, size_t size, const char * body, size_t blen );
+
+#endif /* KLOG_H_ */
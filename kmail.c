@@ -8,11 +8,28 @@
 #include "kmail.h"
 #include "mime.h"
 #include "addr.h"
+#include "kio.h"
+#include <sys/stat.h>
+#include <ctype.h>
+
+/*
+ * KSMTP_KNET_EXT: build against a knet that has the calls added after its
+ * last release. Without it the EHLO reply is not read, so no extension is
+ * used, MAIL FROM goes without parameters, TLS sessions are not resumed,
+ * socket timeouts stay at the mail_Create() value and a transaction is
+ * reset by opening the session again, there is no RSET.
+ */
+#ifdef KSMTP_KNET_EXT
+#define mail_EhloReply( mail ) sstr( (mail)->smtp->ehlo )
+#else
+#define mail_EhloReply( mail ) ""
+#endif
 
 KMail mail_Create( KmailFlags flags, const char * node, int timeout )
 {
     KMail mail = (KMail)Calloc( sizeof(struct _KMail), 1 );
     if( !mail ) return NULL;
+    KMEM_SCOPE( &mail->mem );
 
     mail->smtp = smtp_Create( timeout, node, flags & KMAIL_VERBOSE_SMTP );
 
@@ -23,8 +40,17 @@ KMail mail_Create( KmailFlags flags, const char * node, int timeout )
     mail->password = snew();
     mail->host = snew();
     mail->port = 25;
+    mail->max_rcpt = KMAIL_MAX_RCPT;
+    mail->tls = tlscache_Create();
+    if( flags & KMAIL_VERBOSE_MSG )
+    {
+        KLog log = klog_Create( stderr, 1, KLOG_MAX_BODY );
+        if( !mail_SetLog( mail, log ) ) klog_Destroy( log );
+        else mail->own_log = 1;
+    }
 
-    if( !mail->error || !mail->login || !mail->password || !mail->port )
+    if( !mail->error || !mail->login || !mail->password || !mail->port
+            || !mail->tls || ((flags & KMAIL_VERBOSE_MSG) && !mail->log) )
     {
         mail_Destroy( mail );
         mail = NULL;
@@ -34,10 +60,19 @@ KMail mail_Create( KmailFlags flags, const char * node, int timeout )
 
 void mail_Destroy( KMail mail )
 {
+    KMEM_SCOPE( &mail->mem );
     sdel( mail->error );
     sdel( mail->login );
     sdel( mail->password );
     sdel( mail->host );
+    dkim_Destroy( mail->dkim );
+    tlscache_Unref( mail->tls );
+    kpipe_PoolUnref( mail->pool );
+    if( mail->relay ) relay_Release( mail->relays, mail->relay );
+    relay_Unref( mail->relays );
+    if( mail->own_log ) klog_Destroy( mail->log );
+    Free( mail->lbody );
+    Free( mail->status );
     smtp_Destroy( mail->smtp );
     Free( mail );
 }
@@ -77,19 +112,293 @@ int mail_SetPort( KMail mail, int port )
     return 0;
 }
 
+int mail_SetDkim( KMail mail, const char * domain, const char * selector,
+        const char * keyfile )
+{
+    KMEM_SCOPE( &mail->mem );
+    KDkim dkim = dkim_Create( domain, selector, keyfile, mail->error );
+    if( dkim )
+    {
+        dkim_Destroy( mail->dkim );
+        mail->dkim = dkim;
+        return 1;
+    }
+    return 0;
+}
+
+static int digits( const char * s, size_t min, size_t max, int * value )
+{
+    size_t n = 0;
+
+    *value = 0;
+    while( n < max && isdigit( (unsigned char)s[n] ) )
+    {
+        *value = *value * 10 + s[n] - '0';
+        n++;
+    }
+    return n >= min ? (int)n : 0;
+}
+
+/*
+ * The first reply line in the error text ("...: 451 4.7.1 Try later"). The
+ * enhanced code must have the class of the reply code.
+ */
+int mail_GetReply( KMail mail, SmtpReply * reply )
+{
+    const char * start = sstr( mail->error );
+    const char * ptr = start;
+
+    memset( reply, 0, sizeof(SmtpReply) );
+    reply->text = "";
+    while( ptr && *ptr )
+    {
+        if( *ptr >= '2' && *ptr <= '5' && (ptr == start || !isdigit(
+                (unsigned char)ptr[-1] )) && digits( ptr, 3, 3, &reply->code )
+                && (!ptr[3] || ptr[3] == ' ' || ptr[3] == '-') )
+        {
+            break;
+        }
+        reply->code = 0;
+        ptr++;
+    }
+    if( !reply->code ) return 0;
+
+    ptr += 3;
+    if( *ptr ) ptr++;
+    reply->text = ptr;
+    if( *ptr && *ptr == ptr[-4] && ptr[1] == '.' )
+    {
+        int n = digits( ptr + 2, 1, 3, &reply->status[1] );
+        if( n && ptr[2 + n] == '.' )
+        {
+            int m = digits( ptr + 3 + n, 1, 3, &reply->status[2] );
+            if( m && (!ptr[3 + n + m] || isspace( (unsigned char)ptr[3 + n
+                    + m] )) )
+            {
+                reply->status[0] = *ptr - '0';
+                reply->text = ptr + 3 + n + m;
+                while( *reply->text == ' ' )
+                    reply->text++;
+            }
+        }
+        if( !reply->status[0] ) reply->status[1] = reply->status[2] = 0;
+    }
+
+    if( reply->code == 421 || reply->code == 450 || reply->code == 451
+            || (reply->code / 100 == 4 && reply->status[0] == 4
+                    && reply->status[1] == 7) )
+    {
+        reply->kind = SMTP_THROTTLE;
+    }
+    else reply->kind = reply->code >= 500 ? SMTP_PERMANENT :
+            reply->code >= 400 ? SMTP_TRANSIENT : SMTP_POSITIVE;
+    return reply->code;
+}
+
+/*
+ * Every server reply passes here, throttling ones slow the relay down. No
+ * reply at all (the connection failed) or 421 leaves the session broken.
+ */
 static int mail_set_SMTP_error( KMail mail )
 {
+    SmtpReply reply;
+    int code;
+
     scpy( mail->error, mail->smtp->error );
+    code = mail_GetReply( mail, &reply );
+    if( !code || code == 421 ) mail->broken = 1;
+    if( mail->relay && code && reply.kind == SMTP_THROTTLE )
+    {
+        relay_Feedback( mail->relays, mail->relay, 1 );
+    }
     return 0;
 }
 
-int mail_OpenSession( KMail mail, int tls, AuthType auth )
+/*
+ * EHLO reply lines: "250-SIZE 35882577", "250 8BITMIME"...
+ */
+int mail_ParseEhlo( KMail mail, const char * ehlo )
+{
+    KMEM_SCOPE( &mail->mem );
+    const char * line = ehlo;
+
+    mail->caps = 0;
+    mail->max_size = 0;
+    while( line && *line )
+    {
+        const char * kw = line;
+        size_t size;
+
+        if( strlen( kw ) > 4 && isdigit( (unsigned char)*kw ) ) kw += 4;
+        size = strcspn( kw, " \r\n" );
+        if( size == 4 && !strncasecmp( kw, "SIZE", 4 ) )
+        {
+            mail->caps |= KMAIL_CAP_SIZE;
+            if( kw[4] == ' ' ) mail->max_size = strtoul( kw + 5, NULL, 10 );
+        }
+        else if( size == 8 && !strncasecmp( kw, "8BITMIME", 8 ) )
+        {
+            mail->caps |= KMAIL_CAP_8BITMIME;
+        }
+        else if( size == 8 && !strncasecmp( kw, "SMTPUTF8", 8 ) )
+        {
+            mail->caps |= KMAIL_CAP_SMTPUTF8;
+        }
+        line = strchr( line, '\n' );
+        if( line ) line++;
+    }
+    return mail->caps;
+}
+
+int mail_SetTlsCache( KMail mail, KTlsCache cache )
+{
+    if( !cache ) return 0;
+    tlscache_Ref( cache );
+    tlscache_Unref( mail->tls );
+    mail->tls = cache;
+    return 1;
+}
+
+int mail_SetWorkers( KMail mail, size_t workers )
+{
+    KPipePool pool = NULL;
+
+    if( workers && !(pool = kpipe_PoolCreate( workers )) ) return 0;
+    kpipe_PoolUnref( mail->pool );
+    mail->pool = pool;
+    return 1;
+}
+
+int mail_SetPool( KMail mail, KPipePool pool )
+{
+    if( !pool ) return 0;
+    kpipe_PoolRef( pool );
+    kpipe_PoolUnref( mail->pool );
+    mail->pool = pool;
+    return 1;
+}
+
+int mail_AddRelay( KMail mail, const char * host, int port, unsigned weight )
+{
+    KMEM_SCOPE( &mail->mem );
+    if( !mail->relays && !(mail->relays = relay_Create()) ) return 0;
+    return relay_Add( mail->relays, host, port, weight );
+}
+
+int mail_SetRelays( KMail mail, KRelays relays )
+{
+    if( !relays ) return 0;
+    relay_Ref( relays );
+    if( mail->relay ) relay_Release( mail->relays, mail->relay );
+    mail->relay = NULL;
+    relay_Unref( mail->relays );
+    mail->relays = relays;
+    return 1;
+}
+
+static double mail_Clock( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int mail_SetTimeout( KMail mail, KmailTimeout which, int ms )
+{
+    if( which >= KMAIL_TIMEOUTS || ms < 0 ) return 0;
+    mail->timeouts[which] = ms;
+    return 1;
+}
+
+/*
+ * Starts the deadline of a mail_OpenSession() / mail_Send*() call.
+ */
+static void mail_Budget( KMail mail, KmailTimeout which )
+{
+    mail->deadline = mail->timeouts[which] ?
+            mail_Clock() + mail->timeouts[which] : 0;
+}
+
+static double mail_Left( KMail mail )
+{
+    return mail->deadline - mail_Clock();
+}
+
+/*
+ * A phase ran out of time: the server may still answer it later, so the
+ * session is broken.
+ */
+static int mail_Expired( KMail mail )
+{
+    mail->broken = 1;
+    mail_SetError( mail, "Deadline exceeded" );
+    return 0;
+}
+
+/*
+ * Socket timeouts for the next operation: the phase's own, cut to what is
+ * left of the call's budget. knet is told only when they change, and only
+ * with KSMTP_KNET_EXT; without it the budget is checked between phases and
+ * a stalled read waits for the mail_Create() timeout. Returns 0 if the
+ * budget is spent.
+ */
+static int mail_Phase( KMail mail, KmailTimeout phase )
+{
+    int connect = mail->timeouts[KMAIL_T_CONNECT];
+    int io = mail->timeouts[phase];
+
+    if( mail->deadline )
+    {
+        double left = mail_Left( mail );
+        if( left < 1 ) return 0;
+        if( !connect || connect > left ) connect = (int)left;
+        if( !io || io > left ) io = (int)left;
+    }
+#ifdef KSMTP_KNET_EXT
+    if( connect != mail->t_connect || io != mail->t_io )
+    {
+        smtp_SetTimeouts( mail->smtp, connect, io );
+        mail->t_connect = connect;
+        mail->t_io = io;
+    }
+#endif
+    return 1;
+}
+
+/*
+ * TLS connections offer the last session of this host:port and save the
+ * new one after the handshake (and EHLO, TLS 1.3 tickets come late). Needs
+ * KSMTP_KNET_EXT, otherwise every handshake is a full one.
+ */
+static int mail_Connect( KMail mail, int tls, AuthType auth )
 {
+    mail->broken = 0;
+    if( !mail_Phase( mail, KMAIL_T_GREETING ) ) return mail_Expired( mail );
+#ifdef KSMTP_KNET_EXT
+    if( tls )
+    {
+        smtp_SetTlsSession( mail->smtp,
+                tlscache_Get( mail->tls, sstr( mail->host ), mail->port ) );
+    }
+#endif
     if( !smtp_OpenSession( mail->smtp, sstr( mail->host ), mail->port, tls ) )
     {
         return mail_set_SMTP_error( mail );
     }
+#ifdef KSMTP_KNET_EXT
+    if( tls )
+    {
+        if( smtp_TlsResumed( mail->smtp ) )
+        {
+            __sync_add_and_fetch( &mail->tls->resumed, 1 );
+        }
+        tlscache_Put( mail->tls, sstr( mail->host ), mail->port,
+                smtp_GetTlsSession( mail->smtp ) );
+    }
+#endif
+    mail_ParseEhlo( mail, mail_EhloReply( mail ) );
 
+    if( !mail_Phase( mail, KMAIL_T_COMMAND ) ) return mail_Expired( mail );
     if( auth == AUTH_PLAIN )
     {
         if( !smtp_AUTH_PLAIN( mail->smtp, sstr( mail->login ),
@@ -109,253 +418,662 @@ int mail_OpenSession( KMail mail, int tls, AuthType auth )
     return 1;
 }
 
-void mail_CloseSession( KMail mail )
+int mail_SetLog( KMail mail, KLog log )
 {
-    smtp_CloseSession( mail->smtp );
+    KMEM_SCOPE( &mail->mem );
+    char * lbody = NULL;
+
+    if( log && log->max_body && !(lbody = Malloc( log->max_body )) ) return 0;
+    if( mail->own_log ) klog_Destroy( mail->log );
+    Free( mail->lbody );
+    mail->own_log = 0;
+    mail->log = log;
+    mail->lbody = lbody;
+    return 1;
 }
 
-static int delMFile( MFile file )
+static void mail_LogConnect( KMail mail )
 {
-    sdel( file->body );
-    sdel( file->headers );
-    return 0;
+    if( mail->log ) klog_Write( mail->log, sstr( mail->host ), "connect", 0,
+            mail_GetError( mail ), 0, NULL, 0 );
 }
 
-static int mail_EmbedFiles( KMail mail, KMsg msg, const char * boundary )
+/*
+ * One record per sampled transaction: the phase it failed in or "sent".
+ */
+static void mail_LogBegin( KMail mail )
 {
-    struct _MFile file =
-    { NULL, NULL };
-    EFile efile = lfirst( msg->efiles );
-    file.headers = snew();
+    mail->logging = mail->log && klog_Sample( mail->log );
+    mail->lsize = 0;
+    mail->blen = 0;
+}
 
-    while( efile )
+static void mail_LogData( KMail mail, const char * buf, size_t size )
+{
+    size_t n = mail->log->max_body - mail->blen;
+    if( n > size ) n = size;
+    if( n ) memcpy( mail->lbody + mail->blen, buf, n );
+    mail->blen += n;
+    mail->lsize += size;
+}
+
+static void mail_LogEnd( KMail mail, const char * id, const char * phase,
+        int rc )
+{
+    if( !mail->logging ) return;
+    klog_Write( mail->log, id, rc ? "sent" : phase, rc,
+            rc ? "" : mail_GetError( mail ), mail->lsize, mail->lbody,
+            mail->blen );
+    mail->logging = 0;
+}
+
+/*
+ * Session setup time is the relay latency, a failed setup moves on to the
+ * next relay right away, while the KMAIL_T_SESSION budget lasts. Waiting
+ * for a free relay slot counts against the budget too.
+ */
+int mail_OpenSession( KMail mail, int tls, AuthType auth )
+{
+    KMEM_SCOPE( &mail->mem );
+    char tried[KRELAY_MAX];
+    size_t i;
+
+    mail_Budget( mail, KMAIL_T_SESSION );
+    mail->s_tls = tls;
+    mail->s_auth = auth;
+    if( mail->relay ) relay_Release( mail->relays, mail->relay );
+    mail->relay = NULL;
+    if( !mail->relays || !mail->relays->count )
     {
-        if( !msg_CreateFile( msg, &file, mail->error, boundary, efile->name,
-                efile->ctype, "inline", efile->cid ) )
+        if( mail_Connect( mail, tls, auth ) ) return 1;
+        mail_LogConnect( mail );
+        return 0;
+    }
+
+    memset( tried, 0, sizeof(tried) );
+    for( i = 0; i < mail->relays->count; i++ )
+    {
+        double start;
+        SmtpReply reply;
+        Relay relay;
+
+        if( mail->deadline && mail_Left( mail ) < 1 ) return mail_Expired( mail );
+        relay = relay_Pick( mail->relays, tried,
+                mail->deadline ? (long)mail_Left( mail ) : -1 );
+        if( !relay )
+        {
+            if( mail->deadline && mail_Left( mail ) < 1 ) return mail_Expired(
+                    mail );
+            if( !i ) mail_SetError( mail, "mail_OpenSession(), all relays "
+                    "are busy" );
+            break;
+        }
+        tried[relay->idx] = 1;
+        if( !mail_SetSMTP( mail, relay->host, relay->port ) )
+        {
+            relay_Release( mail->relays, relay );
+            mail_SetError( mail, "mail_OpenSession(), internal error" );
+            return 0;
+        }
+        start = mail_Clock();
+        mail->relay = relay;
+        if( mail_Connect( mail, tls, auth ) )
         {
-            return delMFile( &file );
+            relay_Report( mail->relays, relay, 1, mail_Clock() - start );
+            return 1;
         }
-        if( !smtp_write( mail->smtp, sstr( file.headers ) )
-                || !smtp_write( mail->smtp, sstr( file.body ) )
-                || !smtp_write( mail->smtp, "\r\n" ) )
+        mail->relay = NULL;
+        mail_LogConnect( mail );
+        smtp_CloseSession( mail->smtp );
+        relay_Release( mail->relays, relay );
+        /*
+         * A relay that throttles is busy, not broken.
+         */
+        if( !mail_GetReply( mail, &reply ) || reply.kind != SMTP_THROTTLE )
         {
-            mail_FormatError( mail, "mail_EmbedFiles(\"%s\"), internal error",
-                    efile->name );
-            return delMFile( &file );
+            relay_Report( mail->relays, relay, 0, -1 );
         }
-        efile = lnext( msg->efiles );
     }
-    delMFile( &file );
+    return 0;
+}
+
+/*
+ * Only sessions count as relay failures: a rejected message says nothing
+ * about relay health.
+ */
+static void mail_RelayOk( KMail mail )
+{
+    if( !mail->relay ) return;
+    relay_Report( mail->relays, mail->relay, 1, -1 );
+    relay_Feedback( mail->relays, mail->relay, 0 );
+}
+
+/*
+ * Keeps the relay's message rate, called before each transaction.
+ */
+static void mail_Pace( KMail mail )
+{
+    double ms;
+    struct timespec pause;
+
+    if( !mail->relay ) return;
+    ms = relay_Pace( mail->relays, mail->relay );
+    if( mail->deadline && ms > mail_Left( mail ) ) ms = mail_Left( mail );
+    if( ms <= 0 ) return;
+    pause.tv_sec = (time_t)(ms / 1000);
+    pause.tv_nsec = (long)((ms - pause.tv_sec * 1000.0) * 1000000.0);
+    while( nanosleep( &pause, &pause ) && errno == EINTR )
+        ;
+}
+
+void mail_CloseSession( KMail mail )
+{
+    if( mail->relay ) relay_Release( mail->relays, mail->relay );
+    mail->relay = NULL;
+    smtp_CloseSession( mail->smtp );
+}
+
+static int mail_rawWriter( void * ctx, const char * buf, size_t size )
+{
+    KMail mail = (KMail)ctx;
+    if( mail->logging ) mail_LogData( mail, buf, size );
+    if( !mail_Phase( mail, KMAIL_T_DATA ) ) return mail_Expired( mail );
+    if( !smtp_write_buf( mail->smtp, buf, size ) )
+    {
+        return mail_set_SMTP_error( mail );
+    }
     return 1;
 }
 
-static int mail_AttachFiles( KMail mail, KMsg msg, const char * boundary )
+/*
+ * Everything in DATA goes through the filter (see kfilter.h): mail_DATA()
+ * starts it, mail_writer() feeds it and mail_EndData() completes the last
+ * line.
+ */
+static int mail_DATA( KMail mail )
 {
-    struct _MFile file =
-    { NULL, NULL };
-    Pair afile = lfirst( msg->afiles );
-    file.headers = snew();
+    if( !mail_Phase( mail, KMAIL_T_COMMAND ) ) return mail_Expired( mail );
+    if( !smtp_DATA( mail->smtp ) ) return mail_set_SMTP_error( mail );
+    mail->tx_data = 1;
+    filter_Init( &mail->filter, FILTER_DATA, mail_rawWriter, mail );
+    return 1;
+}
 
-    while( afile )
+static int mail_writer( void * ctx, const char * buf, size_t size )
+{
+    return filter_Write( &((KMail)ctx)->filter, buf, size );
+}
+
+static int mail_EndData( KMail mail )
+{
+    return filter_End( &mail->filter );
+}
+
+/*
+ * RFC 5321 4.1.1.5. Keeps the error of the failed transaction.
+ */
+static int mail_Reset( KMail mail )
+{
+#ifdef KSMTP_KNET_EXT
+    if( !mail_Phase( mail, KMAIL_T_COMMAND ) ) return 0;
+    return smtp_RSET( mail->smtp );
+#else
+    string error = mail->error;
+    int rc;
+
+    if( !(mail->error = snew()) )
     {
-        if( !msg_CreateFile( msg, &file, mail->error, boundary, F_NAME(afile),
-                F_CTYPE(afile), "attachment", NULL ) )
+        mail->error = error;
+        return 0;
+    }
+    smtp_CloseSession( mail->smtp );
+    rc = mail_Connect( mail, mail->s_tls, mail->s_auth );
+    sdel( mail->error );
+    mail->error = error;
+    return rc;
+#endif
+}
+
+/*
+ * Final reply after DATA. Data that failed on our side (a pull source, a
+ * file, the encoder) never gets the final dot: the server would accept the
+ * truncated message. A transaction that sent MAIL FROM but got no DATA
+ * (rejected sender or recipients) is reset, so the session is ready for
+ * the next one. Either way a transaction left open stops the call and
+ * breaks the session: the caller closes it and the server drops it.
+ */
+static int mail_EndTx( KMail mail, int rc )
+{
+    if( mail->tx_data )
+    {
+        mail->tx_mail = mail->tx_data = 0;
+        if( !rc || !mail_Phase( mail, KMAIL_T_FINAL ) )
         {
-            return delMFile( &file );
+            if( rc ) mail_Expired( mail );
+            mail->tx_stop = 1;
+            mail->broken = 1;
+            return 0;
         }
-        if( !smtp_write( mail->smtp, sstr( file.headers ) )
-                || !smtp_write( mail->smtp, sstr( file.body ) )
-                || !smtp_write( mail->smtp, "\r\n" ) )
+        return smtp_END_DATA( mail->smtp ) ? 1 : mail_set_SMTP_error( mail );
+    }
+    if( mail->tx_mail )
+    {
+        mail->tx_mail = 0;
+        if( mail->broken || !mail_Reset( mail ) )
         {
-            mail_FormatError( mail, "mail_AttachFiles(\"%s\"), internal error",
-                    F_NAME(afile) );
-            return delMFile( &file );
+            mail->tx_stop = 1;
+            mail->broken = 1;
         }
-        afile = lnext( msg->afiles );
     }
-    delMFile( &file );
-    return 1;
+    return rc;
 }
 
-static int write_boundary_end( KSmtp smtp, const char * boundary )
+/*
+ * MAIL FROM with SIZE= (RFC 1870) when the server supports it, BODY=8BITMIME
+ * and SMTPUTF8 when the message needs them. Messages over the advertised
+ * limit are refused here, before any data is sent.
+ */
+static int mail_MailFrom( KMail mail, const char * from, size_t size,
+        int needs )
 {
-    return smtp_write( smtp, "--" ) && smtp_write( smtp, boundary )
-            && smtp_write( smtp, "--\r\n" );
+    char params[64];
+
+    *params = 0;
+    if( ((needs & MSG_NEEDS_8BIT) && !(mail->caps & KMAIL_CAP_8BITMIME))
+            || ((needs & MSG_NEEDS_UTF8) && !(mail->caps & KMAIL_CAP_SMTPUTF8)) )
+    {
+        mail_SetError( mail, "Message needs 8BITMIME/SMTPUTF8, "
+                "not supported by server" );
+        return 0;
+    }
+    if( (mail->caps & KMAIL_CAP_SIZE) && size )
+    {
+        if( mail->max_size && size > mail->max_size )
+        {
+            mail_FormatError( mail,
+                    "Message size %zu exceeds server limit %zu", size,
+                    mail->max_size );
+            return 0;
+        }
+        snprintf( params, sizeof(params), "SIZE=%zu", size );
+    }
+    if( needs & MSG_NEEDS_8BIT )
+    {
+        strcat( params, *params ? " BODY=8BITMIME" : "BODY=8BITMIME" );
+    }
+    if( needs & MSG_NEEDS_UTF8 )
+    {
+        strcat( params, *params ? " SMTPUTF8" : "SMTPUTF8" );
+    }
+    if( !mail_Phase( mail, KMAIL_T_COMMAND ) ) return mail_Expired( mail );
+    mail->tx_mail = 1;
+#ifdef KSMTP_KNET_EXT
+    if( *params )
+    {
+        return smtp_MAIL_FROM_EX( mail->smtp, from, params ) ? 1 :
+                mail_set_SMTP_error( mail );
+    }
+#endif
+    return smtp_MAIL_FROM( mail->smtp, from ) ? 1 : mail_set_SMTP_error(
+            mail );
 }
 
-static int write_boundary( KSmtp smtp, const char * boundary )
+int mail_GetReplyCode( KMail mail )
 {
-    return smtp_write( smtp, "--" ) && smtp_write( smtp, boundary )
-            && smtp_write( smtp, "\r\n" );
+    SmtpReply reply;
+    return mail_GetReply( mail, &reply );
 }
 
-int mail_SendMessage( KMail mail, KMsg msg )
+const RcptStatus * mail_GetRcptStatus( KMail mail, size_t * count )
 {
-    Pair addr;
-    int rc = 1;
-    string out = NULL;
-    string related = NULL;
-    string multipart = NULL;
-    char mp_boundary[36];
-    char r_boundary[36];
+    *count = mail->nstatus;
+    return mail->status;
+}
+
+static RcptStatus * mail_StatusAdd( KMail mail, const char * email )
+{
+    RcptStatus * st;
 
-    if( !smtp_MAIL_FROM( mail->smtp, A_EMAIL(msg->from) ) )
+    if( mail->nstatus == mail->sstatus )
     {
-        rc = 0;
-        goto pmend;
+        size_t size = mail->sstatus ? mail->sstatus * 2 : 16;
+        st = Realloc( mail->status, size * sizeof(RcptStatus) );
+        if( !st ) return NULL;
+        mail->status = st;
+        mail->sstatus = size;
     }
+    st = &mail->status[mail->nstatus++];
+    snprintf( st->email, sizeof(st->email), "%s", email );
+    st->state = RS_SKIPPED;
+    st->code = 0;
+    return st;
+}
 
-    addr = lfirst( msg->to );
-    while( addr )
+static void mail_StatusReset( KMail mail )
+{
+    mail->nstatus = 0;
+}
+
+static void mail_TxBegin( KMail mail )
+{
+    mail->tx_first = mail->nstatus;
+    mail->accepted = 0;
+    mail->tx_stop = 0;
+    mail->tx_mail = 0;
+    mail->tx_data = 0;
+}
+
+/*
+ * Every address gets a status, also when the transaction is already
+ * stopped. A rejected one stops it unless KMAIL_PARTIAL is set; 421 and
+ * errors without a reply code always do.
+ */
+static int mail_Rcpt( KMail mail, const char * email )
+{
+    RcptStatus * st = mail_StatusAdd( mail, email );
+
+    if( !st )
     {
-        if( !smtp_RCPT_TO( mail->smtp, A_EMAIL(addr) ) )
-        {
-            rc = 0;
-            goto pmend;
-        }
-        addr = lnext( msg->to );
+        mail_SetError( mail, "mail_SendMessage(), internal error" );
+        mail->tx_stop = 1;
+        return 0;
+    }
+    if( mail->tx_stop ) return 1;
+    if( !mail_Phase( mail, KMAIL_T_COMMAND ) )
+    {
+        mail_Expired( mail );
+        st->state = RS_DEFERRED;
+        mail->tx_stop = 1;
+        return 1;
+    }
+    if( smtp_RCPT_TO( mail->smtp, email ) )
+    {
+        st->state = RS_ACCEPTED;
+        mail->accepted++;
+        return 1;
+    }
+    mail_set_SMTP_error( mail );
+    st->code = mail_GetReplyCode( mail );
+    st->state = st->code >= 500 ? RS_REJECTED : RS_DEFERRED;
+    if( !(mail->flags & KMAIL_PARTIAL) || st->code < 400 || st->code == 421 )
+    {
+        mail->tx_stop = 1;
+    }
+    return 1;
+}
+
+/*
+ * After RCPT: go on to DATA only with accepted recipients.
+ */
+static int mail_TxRcptDone( KMail mail )
+{
+    if( mail->tx_stop ) return 0;
+    if( !mail->accepted )
+    {
+        if( !slen( mail->error ) ) mail_SetError( mail,
+                "No recipients accepted" );
+        return 0;
     }
-    addr = lfirst( msg->cc );
+    return 1;
+}
+
+/*
+ * Accepted recipients share the fate of the transaction, or are skipped
+ * if it stopped on another recipient or before the server answered the
+ * data.
+ */
+static void mail_TxEnd( KMail mail, int rc )
+{
+    size_t i;
+    int code = rc ? 250 : mail->tx_stop ? 0 : mail_GetReplyCode( mail );
+
+    for( i = mail->tx_first; i < mail->nstatus; i++ )
+    {
+        RcptStatus * st = &mail->status[i];
+        if( st->state != RS_ACCEPTED ) continue;
+        st->code = code;
+        if( rc ) st->state = RS_SENT;
+        else if( mail->tx_stop ) st->state = RS_SKIPPED;
+        else st->state = code >= 500 ? RS_REJECTED : RS_DEFERRED;
+    }
+}
+
+static int mail_RcptList( KMail mail, const List list )
+{
+    Pair addr = list ? lfirst( list ) : NULL;
     while( addr )
     {
-        if( !smtp_RCPT_TO( mail->smtp, A_EMAIL(addr) ) )
+        if( !mail_Rcpt( mail, A_EMAIL(addr) ) ) return 0;
+        addr = lnext( list );
+    }
+    return 1;
+}
+
+/*
+ * Pre-pass over frozen message: body hash is computed while the message
+ * is serialized, encoded files are cached for the real pass. Lines are
+ * normalized as in DATA, dot-stuffing is transport only.
+ */
+static string mail_DkimSignature( KMail mail, KMsg msg )
+{
+    DataFilter filter;
+
+    if( !msg_Freeze( msg ) )
+    {
+        mail_SetError( mail, "mail_SendMessage(), internal error" );
+        return NULL;
+    }
+    filter_Init( &filter, FILTER_CRLF | FILTER_LIMIT, dkim_Writer, mail->dkim );
+    if( !dkim_Begin( mail->dkim )
+            || !msg_Write( msg, filter_Write, &filter, mail->error )
+            || !filter_End( &filter ) )
+    {
+        if( !slen( mail->error ) ) mail_SetError( mail,
+                "mail_SendMessage(), DKIM internal error" );
+        return NULL;
+    }
+    return dkim_Sign( mail->dkim, mail->error );
+}
+
+/*
+ * Recipients go grouped by domain, each address once.
+ */
+static int mail_RcptSet( KMail mail, RcptSet set )
+{
+    RcptDomain domain = set->dfirst;
+    while( domain )
+    {
+        Rcpt rcpt = domain->first;
+        while( rcpt )
         {
-            rc = 0;
-            goto pmend;
+            if( !mail_Rcpt( mail, RCPT_EMAIL(rcpt) ) ) return 0;
+            rcpt = rcpt->dnext;
         }
-        addr = lnext( msg->cc );
+        domain = domain->next;
     }
+    return 1;
+}
 
-    addr = lfirst( msg->bcc );
-    while( addr )
+int mail_SendMessage( KMail mail, KMsg msg )
+{
+    KMEM_SCOPE( &mail->mem );
+    int rc = 1;
+    size_t size = 0;
+    string signature = NULL;
+    const char * phase = "dkim";
+    int eightbit = msg->eightbit;
+    int utf8 = msg->utf8;
+    int needs;
+
+    mail_Budget( mail, KMAIL_T_SEND );
+    mail_SetError( mail, "" );
+    mail_StatusReset( mail );
+    mail_TxBegin( mail );
+    mail_LogBegin( mail );
+    if( mail->pool && !msg->pool ) msg_SetPool( msg, mail->pool );
+    msg_SetTransport( msg, mail->caps & KMAIL_CAP_8BITMIME,
+            mail->caps & KMAIL_CAP_SMTPUTF8 );
+    needs = msg_Needs( msg );
+    if( mail->dkim )
     {
-        if( !smtp_RCPT_TO( mail->smtp, A_EMAIL(addr) ) )
+        signature = mail_DkimSignature( mail, msg );
+        if( !signature )
         {
-            rc = 0;
-            goto pmend;
+            msg_Unfreeze( msg );
+            msg_SetTransport( msg, eightbit, utf8 );
+            mail_LogEnd( mail, msg_GetHeader( msg, "Message-ID" ), phase, 0 );
+            return 0;
         }
-        addr = lnext( msg->bcc );
     }
 
-    out = msg_CreateHeaders( msg );
-    if( !out )
+    if( mail->caps & KMAIL_CAP_SIZE )
     {
+        size = signature ? mail->dkim->size + slen( signature ) :
+                msg_Size( msg );
+    }
+    phase = "mail";
+    mail_Pace( mail );
+    if( !mail_MailFrom( mail, A_EMAIL(msg->from), size, needs ) )
+    {
+        mail->tx_stop = 1;
+        mail_RcptSet( mail, msg->rcpts );
         rc = 0;
         goto pmend;
     }
 
-    if( mail->flags & KMAIL_VERBOSE_MSG )
+    phase = "rcpt";
+    if( !mail_RcptSet( mail, msg->rcpts ) || !mail_TxRcptDone( mail ) )
     {
-        fprintf( stderr, "%s", sstr( out ) );
+        rc = 0;
+        goto pmend;
     }
 
-    if( !smtp_DATA( mail->smtp ) || !smtp_write( mail->smtp, sstr( out ) ) )
+    phase = "data";
+    if( !mail_DATA( mail ) )
     {
         rc = 0;
         goto pmend;
     }
 
-    sdel( out );
-    out = msg_CreateBody( msg );
-    if( !out )
+    if( signature
+            && !mail_writer( mail, sstr( signature ), slen( signature ) ) )
     {
         rc = 0;
         goto pmend;
     }
 
-    if( mail->flags & KMAIL_VERBOSE_MSG )
+    if( !msg_Write( msg, mail_writer, mail, mail->error )
+            || !mail_EndData( mail ) )
     {
-        fprintf( stderr, "%s", sstr( out ) );
+        rc = 0;
     }
 
-    if( msg->efiles->size )
+    pmend: rc = mail_EndTx( mail, rc );
+    mail_TxEnd( mail, rc );
+    if( rc ) mail_RelayOk( mail );
+    mail_LogEnd( mail, msg_GetHeader( msg, "Message-ID" ), phase, rc );
+    sdel( signature );
+    if( mail->dkim ) msg_Unfreeze( msg );
+    msg_SetTransport( msg, eightbit, utf8 );
+    return rc;
+}
+
+int mail_SetMaxRcpt( KMail mail, size_t max_rcpt )
+{
+    if( max_rcpt )
     {
-        mimeMakeBoundary( r_boundary );
-        related = sfromchar( "Content-Type: multipart/related; boundary=\"" );
-        if( !related || !xscatc( related, r_boundary, "\"\r\n\r\n", NULL ) )
-        {
-            rc = 0;
-            goto pmend;
-        }
+        mail->max_rcpt = max_rcpt;
+        return 1;
     }
+    return 0;
+}
 
-    if( msg->afiles->size )
+int mail_SendPrepared( KMail mail, KPrepared prep, const List rcpts )
+{
+    KMEM_SCOPE( &mail->mem );
+    Pair addr = rcpts ? lfirst( rcpts ) : NULL;
+    int stop = 0;
+    size_t sent = 0;
+
+    mail_Budget( mail, KMAIL_T_SEND );
+    mail_SetError( mail, "" );
+    mail_StatusReset( mail );
+    if( mail->dkim && !prep->dkim
+            && !dkim_SignPrepared( mail->dkim, prep, mail->error ) )
     {
-        mimeMakeBoundary( mp_boundary );
-        multipart = sfromchar( "Content-Type: multipart/mixed; boundary=\"" );
-        if( !multipart
-                || !xscatc( multipart, mp_boundary, "\"\r\n\r\n", NULL ) )
-        {
-            rc = 0;
-            goto pmend;
-        }
-        if( !smtp_write( mail->smtp, sstr( multipart ) ) )
+        return 0;
+    }
+    while( addr )
+    {
+        int rc = 1;
+        size_t count = 0;
+        const char * phase = "mail";
+
+        mail_TxBegin( mail );
+        mail->tx_stop = stop;
+        if( !stop )
         {
-            rc = 0;
-            goto pmend;
+            mail_LogBegin( mail );
+            mail_Pace( mail );
         }
-        if( slen(out) && !write_boundary( mail->smtp, mp_boundary ) )
+        if( !stop
+                && !mail_MailFrom( mail, prep->from, prep->size, prep->needs ) )
         {
-            rc = 0;
-            goto pmend;
+            mail->tx_stop = 1;
         }
-
-        if( related )
+        else phase = "rcpt";
+        while( addr && count < mail->max_rcpt )
         {
-            if( !smtp_write( mail->smtp, sstr( related ) )
-                    || !write_boundary( mail->smtp, r_boundary )
-                    || !smtp_write( mail->smtp, sstr( out ) )
-                    || !mail_EmbedFiles( mail, msg, r_boundary )
-                    || !write_boundary_end( mail->smtp, r_boundary ) )
-            {
-                rc = 0;
-                goto pmend;
-            }
+            mail_Rcpt( mail, A_EMAIL(addr) );
+            count++;
+            addr = lnext( rcpts );
         }
-
-        if( !mail_AttachFiles( mail, msg, mp_boundary )
-                || !write_boundary_end( mail->smtp, mp_boundary ) )
+        if( stop ) continue;
+        if( !mail_TxRcptDone( mail ) )
         {
             rc = 0;
             goto pmend;
         }
-    }
-    else if( msg->efiles->size )
-    {
-        if( !smtp_write( mail->smtp, sstr( related ) )
-                || !write_boundary( mail->smtp, r_boundary )
-                || !smtp_write( mail->smtp, sstr( out ) )
-                || !mail_EmbedFiles( mail, msg, r_boundary )
-                || !write_boundary_end( mail->smtp, r_boundary ) )
+        phase = "data";
+        if( !mail_DATA( mail ) )
         {
             rc = 0;
             goto pmend;
         }
-    }
-    else
-    {
-        if( slen( out ) && !smtp_write( mail->smtp, sstr( out ) ) )
+        rc = mail_writer( mail, prep->data, prep->size )
+                && mail_EndData( mail );
+
+        pmend: rc = mail_EndTx( mail, rc );
+        mail_TxEnd( mail, rc );
+        mail_LogEnd( mail, prep->from, phase, rc );
+        if( rc )
         {
-            rc = 0;
-            goto pmend;
+            mail_RelayOk( mail );
+            sent++;
         }
+        /*
+         * Only a chunk that failed on its recipients alone lets the next
+         * one go.
+         */
+        else if( mail->tx_stop || mail->broken || mail->accepted ) stop = 1;
     }
-
-    pmend: sdel( out );
-    sdel( related );
-    sdel( multipart );
-    smtp_END_DATA( mail->smtp );
-    return rc;
+    return sent != 0;
 }
 
 int mail_SendFromFile( KMail mail, const char * file, const char * from,
         const List to, const List cc, const List bcc )
 {
-    char buf[1024];
+    KMEM_SCOPE( &mail->mem );
+    const char * buf;
     size_t rc = 1;
-    size_t readed;
-    Pair addr;
-    FILE * msg = fopen( file, "rb" );
+    ssize_t readed;
+    struct stat st;
+    const char * phase = "mail";
+    KReader msg;
+
+    mail_Budget( mail, KMAIL_T_SEND );
+    mail_SetError( mail, "" );
+    msg = kio_Open( file );
     if( !msg )
     {
         mail_FormatError( mail, "mail_SendFromFile(\"%s\") - %s", file,
@@ -363,64 +1081,56 @@ int mail_SendFromFile( KMail mail, const char * file, const char * from,
         return 0;
     }
 
-    if( !smtp_MAIL_FROM( mail->smtp, from ) )
+    mail_StatusReset( mail );
+    mail_TxBegin( mail );
+    mail_LogBegin( mail );
+    mail_Pace( mail );
+    if( !mail_MailFrom( mail, from,
+            fstat( kio_Fd( msg ), &st ) ? 0 : (size_t)st.st_size, 0 ) )
     {
+        mail->tx_stop = 1;
         rc = 0;
-        goto pmend;
     }
+    else phase = "rcpt";
 
-    addr = to ? lfirst( to ) : NULL;
-    while( addr )
+    if( !mail_RcptList( mail, to ) || !mail_RcptList( mail, cc )
+            || !mail_RcptList( mail, bcc ) || !mail_TxRcptDone( mail ) )
     {
-        if( !smtp_RCPT_TO( mail->smtp, A_EMAIL(addr) ) )
-        {
-            rc = 0;
-            goto pmend;
-        }
-        addr = lnext( to );
+        rc = 0;
+        goto pmend;
     }
 
-    addr = cc ? lfirst( cc ) : NULL;
-    while( addr )
+    phase = "data";
+    if( !mail_DATA( mail ) )
     {
-        if( !smtp_RCPT_TO( mail->smtp, A_EMAIL(addr) ) )
-        {
-            rc = 0;
-            goto pmend;
-        }
-        addr = lnext( cc );
+        rc = 0;
+        goto pmend;
     }
-
-    addr = bcc ? lfirst( bcc ) : NULL;
-    while( addr )
+    while( (readed = kio_Read( msg, &buf )) > 0 )
     {
-        if( !smtp_RCPT_TO( mail->smtp, A_EMAIL(addr) ) )
+        if( !(mail->flags & KMAIL_PRESTUFFED ? mail_rawWriter :
+                mail_writer)( mail, buf, (size_t)readed ) )
         {
             rc = 0;
             goto pmend;
         }
-        addr = lnext( bcc );
     }
-
-    if( !smtp_DATA( mail->smtp ) )
+    /*
+     * mail_EndTx() leaves DATA open, the partial file is not delivered.
+     */
+    if( readed < 0 )
     {
+        mail_FormatError( mail, "mail_SendFromFile(\"%s\") - %s", file,
+                strerror(errno) );
         rc = 0;
         goto pmend;
     }
-    while( (readed = fread( buf, 1, sizeof(buf), msg )) > 0 )
-    {
-        if( !smtp_write_buf( mail->smtp, buf, readed ) )
-        {
-            rc = 0;
-            goto pmend;
-        }
-        if( mail->flags & KMAIL_VERBOSE_MSG )
-        {
-            fwrite( buf, 1, readed, stderr );
-        }
-    }
+    if( !(mail->flags & KMAIL_PRESTUFFED) && !mail_EndData( mail ) ) rc = 0;
 
-    pmend: smtp_END_DATA( mail->smtp );
-    fclose( msg );
+    pmend: rc = (size_t)mail_EndTx( mail, (int)rc );
+    mail_TxEnd( mail, (int)rc );
+    if( rc ) mail_RelayOk( mail );
+    mail_LogEnd( mail, file, phase, (int)rc );
+    kio_Close( msg );
     return rc;
 }
@@ -10,17 +10,97 @@
 
 #include "../knet/ksmtp.h"
 #include "kmsg.h"
+#include "dkim.h"
+#include "ktls.h"
+#include "krelay.h"
+#include "klog.h"
+#include "kfilter.h"
 
 typedef enum _AuthType
 {
     AUTH_LOGIN = 1, AUTH_PLAIN = 2
 } AuthType;
 
+/*
+ * KMAIL_VERBOSE_MSG: every message goes to an own asynchronous stderr log,
+ * bodies truncated to KLOG_MAX_BODY bytes (see mail_SetLog()).
+ * KMAIL_PRESTUFFED: files for mail_SendFromFile() are already normalized
+ * and dot-stuffed (msg_WriteTo(..., 1, ...)) and are sent as they are.
+ * KMAIL_PARTIAL: recipients rejected with 4xx/5xx do not stop the message,
+ * it goes to the accepted ones (see mail_GetRcptStatus()).
+ */
 typedef enum _KmailFlags
 {
-    KMAIL_VERBOSE_MSG = 0x01, KMAIL_VERBOSE_SMTP = 0x02, KMAIL_DEFAULT = 0x00
+    KMAIL_VERBOSE_MSG = 0x01, KMAIL_VERBOSE_SMTP = 0x02,
+    KMAIL_PRESTUFFED = 0x04, KMAIL_PARTIAL = 0x08, KMAIL_DEFAULT = 0x00
 } KmailFlags;
 
+/*
+ * Server extensions from the EHLO reply (knet with KSMTP_KNET_EXT only).
+ */
+typedef enum _KmailCaps
+{
+    KMAIL_CAP_SIZE = 0x01, KMAIL_CAP_8BITMIME = 0x02, KMAIL_CAP_SMTPUTF8 = 0x04
+} KmailCaps;
+
+/*
+ * Per-recipient result of the last send. RS_DEFERRED and RS_SKIPPED (not
+ * tried, the transaction stopped before) are worth a retry.
+ */
+typedef enum _RcptState
+{
+    RS_SKIPPED = 0, RS_ACCEPTED, RS_SENT, RS_DEFERRED, RS_REJECTED
+} RcptState;
+
+typedef struct _RcptStatus
+{
+    char email[256];
+    RcptState state;
+    int code;
+} RcptStatus;
+
+/*
+ * Server reply parsed from the last error. 'code' is 0 for connection and
+ * local errors, 'status' is the RFC 3463 enhanced code ({0, 0, 0} if there
+ * is none), 'text' points into the error. SMTP_THROTTLE is a transient
+ * reply that asks to slow down: 421, 450, 451 or 4.7.x.
+ */
+typedef enum _SmtpReplyKind
+{
+    SMTP_NONE = 0, SMTP_POSITIVE, SMTP_TRANSIENT, SMTP_THROTTLE,
+    SMTP_PERMANENT
+} SmtpReplyKind;
+
+typedef struct _SmtpReply
+{
+    int code;
+    int status[3];
+    SmtpReplyKind kind;
+    const char * text;
+} SmtpReply;
+
+/*
+ * Milliseconds, 0 - knet's own (the mail_Create() timeout). A phase
+ * timeout bounds every socket operation of the phase: KMAIL_T_CONNECT the
+ * TCP connect, KMAIL_T_GREETING the banner, EHLO and STARTTLS,
+ * KMAIL_T_COMMAND AUTH/MAIL/RCPT/DATA, KMAIL_T_DATA each block written in
+ * DATA, KMAIL_T_FINAL the reply to the final dot. KMAIL_T_SESSION and
+ * KMAIL_T_SEND are budgets for a whole mail_OpenSession() and mail_Send*()
+ * call: no operation waits longer than what is left of it. Phase timeouts
+ * need KSMTP_KNET_EXT; without it the budgets are only checked between
+ * operations.
+ */
+typedef enum _KmailTimeout
+{
+    KMAIL_T_CONNECT = 0, KMAIL_T_GREETING, KMAIL_T_COMMAND, KMAIL_T_DATA,
+    KMAIL_T_FINAL, KMAIL_T_SESSION, KMAIL_T_SEND, KMAIL_TIMEOUTS
+} KmailTimeout;
+
+/*
+ * RFC 5321 4.5.3.1.8: servers must accept at least 100 RCPT per transaction.
+ */
+#define KMAIL_MAX_RCPT      100
+
 typedef struct _KMail
 {
     KSmtp smtp;
@@ -30,6 +110,51 @@ typedef struct _KMail
     string password;
     string host;
     int port;
+    size_t max_rcpt;
+    KDkim dkim;
+    int caps;
+    size_t max_size;
+    KTlsCache tls;
+    KPipePool pool;
+    KRelays relays;
+    Relay relay;
+    KLog log;
+    int own_log;
+    int logging;
+    size_t lsize;
+    size_t blen;
+    char * lbody;
+    DataFilter filter;
+    RcptStatus * status;
+    size_t nstatus;
+    size_t sstatus;
+    size_t tx_first;
+    size_t accepted;
+    int tx_stop;
+    /*
+     * MAIL FROM / DATA of the current transaction went out, and what
+     * mail_OpenSession() was called with, to open the session again.
+     */
+    int tx_mail;
+    int tx_data;
+    int s_tls;
+    AuthType s_auth;
+    /*
+     * The session can not carry another transaction (see mail_Broken()).
+     */
+    int broken;
+    /*
+     * 'deadline' of the current call (mail_Clock() ms, 0 - none), the
+     * timeouts last given to knet.
+     */
+    int timeouts[KMAIL_TIMEOUTS];
+    double deadline;
+    int t_connect;
+    int t_io;
+    /*
+     * Memory allocated by the session's functions (KSMTP_MEMSTAT).
+     */
+    KMemStat mem;
 
 }*KMail;
 
@@ -37,6 +162,10 @@ KMail mail_Create( KmailFlags flags, const char * node, int timeout );
 void mail_Destroy( KMail mail );
 
 #define mail_GetError( mail ) sstr((mail)->error)
+#define mail_MemStat( mail, out ) kmem_Get( &(mail)->mem, (out) )
+int mail_GetReply( KMail mail, SmtpReply * reply );
+int mail_GetReplyCode( KMail mail );
+const RcptStatus * mail_GetRcptStatus( KMail mail, size_t * count );
 #define mail_SetError( mail, err ) scpyc( (mail)->error, (err) )
 #define mail_FormatError( mail, fmt, ... ) sprint( (mail)->error, (fmt), __VA_ARGS__ )
 
@@ -45,9 +174,63 @@ int mail_SetHost( KMail mail, const char * host );
 int mail_SetPort( KMail mail, int port );
 int mail_SetLogin( KMail mail, const char * login );
 int mail_SetPassword( KMail mail, const char * password );
+int mail_SetMaxRcpt( KMail mail, size_t max_rcpt );
+int mail_SetTimeout( KMail mail, KmailTimeout which, int ms );
+/*
+ * With relays mail_OpenSession() chooses one of them instead of host:port
+ * and fails over to the next one at once. mail_SetRelays() gives back the
+ * slot of an open session, which no longer counts against any relay.
+ */
+int mail_AddRelay( KMail mail, const char * host, int port, unsigned weight );
+int mail_SetRelays( KMail mail, KRelays relays );
+/*
+ * Borrowed log, may be shared by many KMail objects and must outlive them.
+ */
+int mail_SetLog( KMail mail, KLog log );
+int mail_SetDkim( KMail mail, const char * domain, const char * selector,
+        const char * keyfile );
+
+/*
+ * Shares a TLS session cache with other KMail objects (KSMTP_KNET_EXT).
+ */
+int mail_SetTlsCache( KMail mail, KTlsCache cache );
+#define mail_TlsHits( mail )    (mail)->tls->hits
+#define mail_TlsMisses( mail )  (mail)->tls->misses
+#define mail_TlsResumed( mail ) (mail)->tls->resumed
 
+/*
+ * Attachment encoder threads for messages sent by this KMail that have no
+ * pool of their own. mail_SetWorkers() starts them once (0 - none), the
+ * pool may also be shared by several KMail objects, e.g. all the sessions
+ * a kdeliver MailFactory makes.
+ */
+int mail_SetWorkers( KMail mail, size_t workers );
+int mail_SetPool( KMail mail, KPipePool pool );
+
+int mail_ParseEhlo( KMail mail, const char * ehlo );
 int mail_OpenSession( KMail mail, int tls, AuthType auth );
 int mail_SendMessage( KMail mail, KMsg msg );
+/*
+ * After a failed send: 1 if the session must be closed before the next
+ * one. That is the case when the server gave no reply, replied 421 or ran
+ * out of time. A transaction that failed on our side after DATA is not
+ * ended with the final dot, and a transaction that could not be reset is
+ * left as it is: closing the connection makes the server drop it. Other
+ * failures (a rejected sender or recipient...) keep the session usable.
+ */
+#define mail_Broken( mail )     (mail)->broken
+/*
+ * Sends to 'rcpts' in transactions of up to max_rcpt recipients. Returns 1
+ * if at least one of them was delivered; what became of each recipient is
+ * in mail_GetRcptStatus(). With mail_SetDkim() an unsigned 'prep' is
+ * signed in place first, so a KPrepared shared by several sessions must
+ * be signed (dkim_SignPrepared()) before they start.
+ */
+int mail_SendPrepared( KMail mail, KPrepared prep, const List rcpts );
+/*
+ * Sends 'file' as the message. If it can not be read to the end nothing is
+ * delivered: DATA is not ended and the session is broken.
+ */
 int mail_SendFromFile( KMail mail, const char * file, const char * from,
         const List to, const List cc, const List bcc );
 void mail_CloseSession( KMail mail );
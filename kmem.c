@@ -0,0 +1,113 @@
+/*
+ * kmem.c, part of "ksmtp" project.
+ */
+
+#define KMEM_IMPL
+#include "kmem.h"
+
+KMemStat kmem_Total;
+
+void kmem_Get( const KMemStat * stat, KMemStat * out )
+{
+    out->live = __atomic_load_n( &stat->live, __ATOMIC_RELAXED );
+    out->peak = __atomic_load_n( &stat->peak, __ATOMIC_RELAXED );
+    out->allocs = __atomic_load_n( &stat->allocs, __ATOMIC_RELAXED );
+    out->frees = __atomic_load_n( &stat->frees, __ATOMIC_RELAXED );
+}
+
+#ifdef KSMTP_MEMSTAT
+
+#include <malloc.h>
+
+static __thread KMemFrame * kmem_top;
+
+/*
+ * A scope already on the stack (msg_AddTextPart() calling
+ * msg_AddTextPartRef()...) is not charged twice.
+ */
+KMemFrame kmem_Enter( KMemFrame * self, KMemStat * stat )
+{
+    KMemFrame frame;
+    KMemFrame * ptr;
+
+    frame.stat = stat;
+    frame.prev = kmem_top;
+    for( ptr = kmem_top; ptr; ptr = ptr->prev )
+    {
+        if( ptr->stat == stat ) frame.stat = NULL;
+    }
+    kmem_top = self;
+    return frame;
+}
+
+void kmem_Leave( KMemFrame * frame )
+{
+    kmem_top = frame->prev;
+}
+
+static void statAdd( KMemStat * stat, ssize_t bytes, int alloc, int release )
+{
+    ssize_t live = __sync_add_and_fetch( &stat->live, bytes );
+    ssize_t peak = stat->peak;
+
+    while( live > peak )
+    {
+        if( __sync_bool_compare_and_swap( &stat->peak, peak, live ) ) break;
+        peak = stat->peak;
+    }
+    if( alloc ) __sync_add_and_fetch( &stat->allocs, 1 );
+    if( release ) __sync_add_and_fetch( &stat->frees, 1 );
+}
+
+static void charge( ssize_t bytes, int alloc, int release )
+{
+    KMemFrame * frame;
+
+    statAdd( &kmem_Total, bytes, alloc, release );
+    for( frame = kmem_top; frame; frame = frame->prev )
+        if( frame->stat ) statAdd( frame->stat, bytes, alloc, release );
+}
+
+void kmem_Charge( ssize_t bytes )
+{
+    charge( bytes, 0, 0 );
+}
+
+void * kmem_Malloc( size_t size )
+{
+    void * ptr = Malloc( size );
+    if( ptr ) charge( (ssize_t)malloc_usable_size( ptr ), 1, 0 );
+    return ptr;
+}
+
+void * kmem_Calloc( size_t n, size_t size )
+{
+    void * ptr = Calloc( n, size );
+    if( ptr ) charge( (ssize_t)malloc_usable_size( ptr ), 1, 0 );
+    return ptr;
+}
+
+void * kmem_Realloc( void * ptr, size_t size )
+{
+    size_t old = ptr ? malloc_usable_size( ptr ) : 0;
+    void * nptr = Realloc( ptr, size );
+    if( nptr ) charge( (ssize_t)malloc_usable_size( nptr ) - (ssize_t)old,
+            !ptr, 0 );
+    return nptr;
+}
+
+char * kmem_Strdup( const char * s )
+{
+    char * ptr = Strdup( s );
+    if( ptr ) charge( (ssize_t)malloc_usable_size( ptr ), 1, 0 );
+    return ptr;
+}
+
+void kmem_Free( void * ptr )
+{
+    if( !ptr ) return;
+    charge( -(ssize_t)malloc_usable_size( ptr ), 0, 1 );
+    Free( ptr );
+}
+
+#endif
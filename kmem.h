@@ -0,0 +1,88 @@
+/*
+ * kmem.h, part of "ksmtp" project.
+ */
+
+#ifndef KMEM_H_
+#define KMEM_H_
+
+#include "../klib/config.h"
+#include <sys/types.h>
+
+/*
+ * Live and peak bytes (as malloc_usable_size() sees them), allocation and
+ * free counts. All zero unless built with KSMTP_MEMSTAT.
+ */
+typedef struct _KMemStat
+{
+    ssize_t live;
+    ssize_t peak;
+    size_t allocs;
+    size_t frees;
+} KMemStat;
+
+typedef struct _KMemFrame
+{
+    KMemStat * stat;
+    struct _KMemFrame * prev;
+} KMemFrame;
+
+/*
+ * Whole process, through the wrappers only.
+ */
+extern KMemStat kmem_Total;
+
+/*
+ * Consistent enough copy of 'stat' for reporting.
+ */
+void kmem_Get( const KMemStat * stat, KMemStat * out );
+
+#ifdef KSMTP_MEMSTAT
+
+/*
+ * Scopes nest per thread: an allocation is charged to every scope on the
+ * thread's stack (message inside session...), a free is taken from them.
+ * Memory freed in another scope than it was allocated in is taken from
+ * that one, so per-object 'live' is an estimate; totals are exact.
+ */
+KMemFrame kmem_Enter( KMemFrame * self, KMemStat * stat );
+void kmem_Leave( KMemFrame * frame );
+void kmem_Charge( ssize_t bytes );
+
+void * kmem_Malloc( size_t size );
+void * kmem_Calloc( size_t n, size_t size );
+void * kmem_Realloc( void * ptr, size_t size );
+char * kmem_Strdup( const char * s );
+void kmem_Free( void * ptr );
+
+#ifndef KMEM_IMPL
+#undef Malloc
+#undef Calloc
+#undef Realloc
+#undef Strdup
+#undef Free
+#define Malloc( size )          kmem_Malloc( size )
+#define Calloc( n, size )       kmem_Calloc( (n), (size) )
+#define Realloc( ptr, size )    kmem_Realloc( (ptr), (size) )
+#define Strdup( s )             kmem_Strdup( s )
+#define Free( ptr )             kmem_Free( ptr )
+#endif
+
+/*
+ * Charges the rest of the C block to 'stat', left automatically on every
+ * return.
+ */
+#define KMEM_SCOPE( stat ) KMemFrame kmem_frame_ \
+    __attribute__((cleanup(kmem_Leave))) = kmem_Enter( &kmem_frame_, (stat) )
+/*
+ * Memory the wrappers do not see (stringlib buffers).
+ */
+#define KMEM_CHARGE( bytes )    kmem_Charge( (ssize_t)(bytes) )
+
+#else
+
+#define KMEM_SCOPE( stat )      (void)(stat)
+#define KMEM_CHARGE( bytes )    (void)(bytes)
+
+#endif
+
+#endif /* KMEM_H_ */
@@ -5,15 +5,22 @@
  *      Author: Vsevolod Lutovinov <klopp@yandex.ru>
  */
 
-#include "kmsg.h"
+#include "kmsg_int.h"
 #include "addr.h"
 #include "mime.h"
+#include "kio.h"
+#include "kfilter.h"
 #include <errno.h>
+#include <pthread.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 static void delTextPart( void * ptr )
 {
     TextPart part = (TextPart)ptr;
+    kbuf_Unref( part->shared );
+    Free( part->encoded );
     Free( part->body );
     Free( part->ctype );
     Free( part );
@@ -22,29 +29,51 @@ static void delTextPart( void * ptr )
 static void delEFile( void *ptr )
 {
     EFile file = (EFile)ptr;
+    kbuf_Unref( file->shared );
     Free( file->name );
     Free( file->ctype );
+    Free( file->zname );
     Free( file );
 }
 
+/*
+ * Any change of the content makes a new message with a new Message-ID.
+ */
+#define MSG_CHANGED( msg )          (*(msg)->msgid = 0)
+#define MSG_DIRTY( msg, section )   ((msg)->dirty |= 1U << (section), \
+        MSG_CHANGED( msg ))
+
+static void dropHeaders( KMsg msg )
+{
+    int i;
+    for( i = 0; i < MSG_H_SECTIONS; i++ )
+    {
+        if( !msg->hcache[i] ) continue;
+        KMEM_CHARGE( -(ssize_t)slen( msg->hcache[i] ) );
+        sdel( msg->hcache[i] );
+        msg->hcache[i] = NULL;
+    }
+    msg->dirty = MSG_D_ALL;
+}
+
 KMsg msg_Create( void )
 {
     KMsg msg = (KMsg)Calloc( sizeof(struct _KMsg), 1 );
     if( !msg ) return NULL;
+    KMEM_SCOPE( &msg->mem );
 
     msg->parts = lcreate( delTextPart );
-    msg->afiles = plcreate();
+    msg->afiles = lcreate( delEFile );
     msg->efiles = lcreate( delEFile );
-    msg->bcc = plcreate();
-    msg->cc = plcreate();
-    msg->to = plcreate();
+    msg->rcpts = rcpt_Create();
     msg->headers = plcreate();
 
     msg->replyto = Calloc( sizeof(struct _Pair), 1 );
     msg->from = Calloc( sizeof(struct _Pair), 1 );
+    msg->dirty = MSG_D_ALL;
 
-    if( msg->from && msg->replyto && msg->headers && msg->to && msg->cc
-            && msg->bcc && msg->parts && msg->afiles && msg->efiles )
+    if( msg->from && msg->replyto && msg->headers && msg->rcpts
+            && msg->parts && msg->afiles && msg->efiles )
     {
         msg_SetCharset( msg, KMSG_DEFAULT_CHARSET );
         return msg;
@@ -56,24 +85,26 @@ KMsg msg_Create( void )
 
 void msg_Destroy( KMsg msg )
 {
+    KMEM_SCOPE( &msg->mem );
+    msg_Unfreeze( msg );
+    dropHeaders( msg );
     ldestroy( msg->parts );
     ldestroy( msg->afiles );
     ldestroy( msg->efiles );
     ldestroy( msg->headers );
-    ldestroy( msg->to );
-    ldestroy( msg->cc );
-    ldestroy( msg->bcc );
+    rcpt_Destroy( msg->rcpts );
 
-    pair_Delete( msg->from );
-    pair_Delete( msg->replyto );
+    deleteAddr( msg->from );
+    deleteAddr( msg->replyto );
 
     Free( msg->subject );
     Free( msg->xmailer );
+    kpipe_PoolUnref( msg->pool );
 
     Free( msg );
 }
 
-int msg_AddTextPart( KMsg msg, const char * body, const char *ctype,
+static TextPart newTextPart( KMsg msg, const char * ctype,
         const char * charset )
 {
     TextPart part = (TextPart)lfirst( msg->parts );
@@ -86,33 +117,74 @@ int msg_AddTextPart( KMsg msg, const char * body, const char *ctype,
         part = (TextPart)lnext( msg->parts );
     }
 
-    part = Malloc( sizeof(struct _TextPart) );
-    if( !part ) return 0;
-    part->body = Strdup( body );
-    if( !part->body )
-    {
-        Free( part );
-        return 0;
-    }
+    part = Calloc( sizeof(struct _TextPart), 1 );
+    if( !part ) return NULL;
+    part->fits = -1;
     part->ctype = Strdup( ctype );
     if( !part->ctype )
     {
         delTextPart( part );
-        return 0;
+        return NULL;
     }
     strncpy( part->charset, charset ? charset : msg->charset,
             sizeof(part->charset) - 1 );
     if( !isUsAsciiCs( part->charset ) ) snprintf( part->cprefix,
             sizeof(part->cprefix) - 1, "=?%s?B?", part->charset );
     else *part->cprefix = 0;
+    return part;
+}
+
+static int addTextPart( KMsg msg, TextPart part )
+{
     if( !ladd( msg->parts, part ) )
     {
         delTextPart( part );
         return 0;
     }
+    MSG_CHANGED( msg );
     return 1;
 }
 
+int msg_AddTextPart( KMsg msg, const char * body, const char *ctype,
+        const char * charset )
+{
+    KMEM_SCOPE( &msg->mem );
+    TextPart part = newTextPart( msg, ctype, charset );
+    if( !part ) return 0;
+    part->body = Strdup( body );
+    if( !part->body )
+    {
+        delTextPart( part );
+        return 0;
+    }
+    part->data = part->body;
+    part->size = strlen( part->body );
+    return addTextPart( msg, part );
+}
+
+int msg_AddTextPartRef( KMsg msg, const char * body, size_t size,
+        const char * ctype, const char * charset )
+{
+    KMEM_SCOPE( &msg->mem );
+    TextPart part = newTextPart( msg, ctype, charset );
+    if( !part ) return 0;
+    part->data = body;
+    part->size = size;
+    return addTextPart( msg, part );
+}
+
+int msg_AddSharedTextPart( KMsg msg, KBuffer body, const char * ctype,
+        const char * charset )
+{
+    KMEM_SCOPE( &msg->mem );
+    TextPart part = newTextPart( msg, ctype, charset );
+    if( !part ) return 0;
+    part->shared = kbuf_Ref( body );
+    part->data = body->data;
+    part->size = body->size;
+    return addTextPart( msg, part );
+}
+
 int msg_AddDefTextPart( KMsg msg, const char * body, const char *ctype )
 {
     return msg_AddTextPart( msg, body, ctype, NULL );
@@ -126,11 +198,13 @@ int msg_AddUtfTextPart( KMsg msg, const char * body, const char *ctype )
 
 int msg_SetReplyTo( KMsg msg, const char * rto )
 {
+    KMEM_SCOPE( &msg->mem );
     Pair addr = createAddr( rto );
     if( addr )
     {
-        pair_Delete( msg->replyto );
+        deleteAddr( msg->replyto );
         msg->replyto = addr;
+        MSG_DIRTY( msg, MSG_H_ADDR );
         return 1;
     }
     return 0;
@@ -138,88 +212,113 @@ int msg_SetReplyTo( KMsg msg, const char * rto )
 
 int msg_SetFrom( KMsg msg, const char * from )
 {
+    KMEM_SCOPE( &msg->mem );
     Pair addr = createAddr( from );
     if( addr )
     {
-        pair_Delete( msg->from );
+        deleteAddr( msg->from );
         msg->from = addr;
+        MSG_DIRTY( msg, MSG_H_ADDR );
         return 1;
     }
     return 0;
 }
 
+int msg_AddTo( KMsg msg, const char * to )
+{
+    KMEM_SCOPE( &msg->mem );
+    MSG_DIRTY( msg, MSG_H_RCPT );
+    return rcpt_Add( msg->rcpts, to, RCPT_TO ) != 0;
+}
+
 int msg_AddCc( KMsg msg, const char * cc )
 {
-    Pair addr = createAddr( cc );
-    if( addr )
-    {
-        if( !ladd( msg->cc, addr ) )
-        {
-            pair_Delete( addr );
-            return 0;
-        }
-    }
-    return 1;
+    KMEM_SCOPE( &msg->mem );
+    MSG_DIRTY( msg, MSG_H_RCPT );
+    return rcpt_Add( msg->rcpts, cc, RCPT_CC ) != 0;
 }
-void smtpClearCc( KMsg msg )
+
+/*
+ * Bcc is not in the headers, and an address already in To/Cc stays there.
+ */
+int msg_AddBcc( KMsg msg, const char * bcc )
 {
-    plclear( msg->cc );
+    KMEM_SCOPE( &msg->mem );
+    MSG_CHANGED( msg );
+    return rcpt_Add( msg->rcpts, bcc, RCPT_BCC ) != 0;
 }
-void smtpClearTo( KMsg msg )
+
+int msg_RemoveRcpt( KMsg msg, const char * email )
 {
-    plclear( msg->to );
+    KMEM_SCOPE( &msg->mem );
+    MSG_DIRTY( msg, MSG_H_RCPT );
+    return rcpt_Remove( msg->rcpts, email );
 }
-int msg_AddBcc( KMsg msg, const char * bcc )
+
+void msg_ClearTo( KMsg msg )
 {
-    Pair addr = createAddr( bcc );
-    if( addr )
-    {
-        if( !ladd( msg->bcc, addr ) )
-        {
-            pair_Delete( addr );
-            return 0;
-        }
-    }
-    return 1;
+    KMEM_SCOPE( &msg->mem );
+    MSG_DIRTY( msg, MSG_H_RCPT );
+    rcpt_Clear( msg->rcpts, RCPT_TO );
 }
-void smtpClearBcc( KMsg msg )
+
+void msg_ClearCc( KMsg msg )
 {
-    lclear( msg->bcc );
+    KMEM_SCOPE( &msg->mem );
+    MSG_DIRTY( msg, MSG_H_RCPT );
+    rcpt_Clear( msg->rcpts, RCPT_CC );
 }
 
-int msg_AddTo( KMsg msg, const char * to )
+void msg_ClearBcc( KMsg msg )
 {
-    Pair addr = createAddr( to );
-    if( addr )
-    {
-        if( !ladd( msg->to, addr ) )
-        {
-            Free( addr );
-            return 0;
-        }
-    }
-    return 1;
+    KMEM_SCOPE( &msg->mem );
+    MSG_CHANGED( msg );
+    rcpt_Clear( msg->rcpts, RCPT_BCC );
 }
 
 int msg_AddHeader( KMsg msg, const char * key, const char * value )
 {
+    KMEM_SCOPE( &msg->mem );
+    MSG_DIRTY( msg, MSG_H_EXTRA );
     return pladd( msg->headers, key, value ) != NULL;
 }
 
+const char * msg_GetHeader( KMsg msg, const char * key )
+{
+    Pair header = lfirst( msg->headers );
+    while( header )
+    {
+        if( !strcasecmp( H_NAME(header), key ) ) return H_VALUE(header);
+        header = lnext( msg->headers );
+    }
+    if( *msg->msgid && !strcasecmp( key, "Message-ID" ) ) return msg->msgid;
+    return NULL;
+}
+
+void msg_NewMessageId( KMsg msg )
+{
+    *msg->msgid = 0;
+}
+
 int msg_AddXMailer( KMsg msg, const char * xmailer )
 {
+    KMEM_SCOPE( &msg->mem );
     return msg_AddHeader( msg, "X-Mailer", xmailer );
 }
 
 void msg_ClearHeaders( KMsg msg )
 {
+    KMEM_SCOPE( &msg->mem );
+    MSG_DIRTY( msg, MSG_H_EXTRA );
     lclear( msg->headers );
 }
 
-const char * msg_EmbedFile( KMsg msg, const char * name, const char * ctype )
+static EFile newEFile( const char * name, const char * ctype,
+        SourceType type )
 {
     EFile file = Calloc( sizeof(struct _EFile), 1 );
     if( !file ) return NULL;
+    file->type = type;
     file->name = Strdup( name );
     if( !file->name )
     {
@@ -235,6 +334,12 @@ const char * msg_EmbedFile( KMsg msg, const char * name, const char * ctype )
             return NULL;
         }
     }
+    return file;
+}
+
+static const char * addEFile( KMsg msg, EFile file )
+{
+    if( !file ) return NULL;
     msg->lastid++;
     sprintf( file->cid, "%s%zu", KFILE_CONTENT_ID, msg->lastid );
     if( !ladd( msg->efiles, file ) )
@@ -242,31 +347,178 @@ const char * msg_EmbedFile( KMsg msg, const char * name, const char * ctype )
         delEFile( file );
         return NULL;
     }
+    MSG_CHANGED( msg );
     return file->cid;
 }
 
+static const char * baseName( const char * name )
+{
+    const char * ptr = strrchr( name, '/' );
+    if( !ptr ) ptr = strrchr( name, '\\' );
+    return ptr ? ptr + 1 : name;
+}
+
+/*
+ * "report.csv" is sent as "report.csv.gz" or "report.zip" (with
+ * "report.csv" inside).
+ */
+static EFile zipFile( EFile file, ZipMethod method )
+{
+    const char * base;
+    const char * ext;
+    size_t size;
+
+    if( !file || method == ZIP_NONE ) return file;
+    base = baseName( file->name );
+    ext = method == ZIP_ZIP ? strrchr( base, '.' ) : NULL;
+    size = (ext && ext != base ? (size_t)(ext - base) : strlen( base ));
+    file->zname = Malloc( size + sizeof(".zip") );
+    if( !file->zname )
+    {
+        delEFile( file );
+        return NULL;
+    }
+    memcpy( file->zname, base, size );
+    strcpy( file->zname + size, method == ZIP_ZIP ? ".zip" : ".gz" );
+    file->zip = method;
+    return file;
+}
+
+static int addAFile( KMsg msg, EFile file )
+{
+    if( !file ) return 0;
+    if( !ladd( msg->afiles, file ) )
+    {
+        delEFile( file );
+        return 0;
+    }
+    MSG_CHANGED( msg );
+    return 1;
+}
+
+static EFile bufferFile( const char * name, const void * data, size_t size,
+        const char * ctype )
+{
+    EFile file = newEFile( name, ctype, MSRC_BUFFER );
+    if( file )
+    {
+        file->data = (const char *)data;
+        file->size = size;
+    }
+    return file;
+}
+
+static EFile sharedFile( const char * name, KBuffer buf, const char * ctype )
+{
+    EFile file = newEFile( name, ctype, MSRC_SHARED );
+    if( file ) file->shared = kbuf_Ref( buf );
+    return file;
+}
+
+static EFile pullFile( const char * name, MsgPull pull, void * ctx,
+        const char * ctype )
+{
+    EFile file = newEFile( name, ctype, MSRC_PULL );
+    if( file )
+    {
+        file->pull = pull;
+        file->pull_ctx = ctx;
+    }
+    return file;
+}
+
+const char * msg_EmbedFile( KMsg msg, const char * name, const char * ctype )
+{
+    KMEM_SCOPE( &msg->mem );
+    return addEFile( msg, newEFile( name, ctype, MSRC_FILE ) );
+}
+
+const char * msg_EmbedBuffer( KMsg msg, const char * name, const void * data,
+        size_t size, const char * ctype )
+{
+    KMEM_SCOPE( &msg->mem );
+    return addEFile( msg, bufferFile( name, data, size, ctype ) );
+}
+
+const char * msg_EmbedShared( KMsg msg, const char * name, KBuffer buf,
+        const char * ctype )
+{
+    KMEM_SCOPE( &msg->mem );
+    return addEFile( msg, sharedFile( name, buf, ctype ) );
+}
+
+const char * msg_EmbedPull( KMsg msg, const char * name, MsgPull pull,
+        void * ctx, const char * ctype )
+{
+    KMEM_SCOPE( &msg->mem );
+    return addEFile( msg, pullFile( name, pull, ctx, ctype ) );
+}
+
 int msg_AttachFile( KMsg msg, const char * name, const char * ctype )
 {
-    return pladd( msg->afiles, name, ctype ) != NULL;
+    KMEM_SCOPE( &msg->mem );
+    return addAFile( msg, newEFile( name, ctype, MSRC_FILE ) );
+}
+
+int msg_AttachBuffer( KMsg msg, const char * name, const void * data,
+        size_t size, const char * ctype )
+{
+    KMEM_SCOPE( &msg->mem );
+    return addAFile( msg, bufferFile( name, data, size, ctype ) );
+}
+
+int msg_AttachFileZip( KMsg msg, const char * name, ZipMethod method )
+{
+    KMEM_SCOPE( &msg->mem );
+    return addAFile( msg, zipFile( newEFile( name, NULL, MSRC_FILE ),
+            method ) );
+}
+
+int msg_AttachBufferZip( KMsg msg, const char * name, const void * data,
+        size_t size, ZipMethod method )
+{
+    KMEM_SCOPE( &msg->mem );
+    return addAFile( msg, zipFile( bufferFile( name, data, size, NULL ),
+            method ) );
+}
+
+int msg_AttachShared( KMsg msg, const char * name, KBuffer buf,
+        const char * ctype )
+{
+    KMEM_SCOPE( &msg->mem );
+    return addAFile( msg, sharedFile( name, buf, ctype ) );
+}
+
+int msg_AttachPull( KMsg msg, const char * name, MsgPull pull, void * ctx,
+        const char * ctype )
+{
+    KMEM_SCOPE( &msg->mem );
+    return addAFile( msg, pullFile( name, pull, ctx, ctype ) );
 }
 
-void smtpClearAFiles( KMsg msg )
+void msg_ClearAFiles( KMsg msg )
 {
+    KMEM_SCOPE( &msg->mem );
+    MSG_CHANGED( msg );
     lclear( msg->afiles );
 }
 
-void smtpClearEFiles( KMsg msg )
+void msg_ClearEFiles( KMsg msg )
 {
+    KMEM_SCOPE( &msg->mem );
+    MSG_CHANGED( msg );
     lclear( msg->efiles );
 }
 
 int msg_SetSubject( KMsg msg, const char * subj )
 {
+    KMEM_SCOPE( &msg->mem );
     char * s = Strdup( subj );
     if( s )
     {
         Free( msg->subject );
         msg->subject = s;
+        MSG_DIRTY( msg, MSG_H_SUBJECT );
         return 0;
     }
     return 1;
@@ -278,10 +530,13 @@ void msg_SetCharset( KMsg msg, const char * charset )
     if( !isUsAsciiCs( charset ) ) snprintf( msg->cprefix,
             sizeof(msg->cprefix) - 1, "=?%s?B?", charset );
     else *msg->cprefix = 0;
+    msg->dirty = MSG_D_ALL;
+    MSG_CHANGED( msg );
 }
 
 int msg_SetXmailer( KMsg msg, const char * xmailer )
 {
+    KMEM_SCOPE( &msg->mem );
     char * x = Strdup( xmailer );
     if( x )
     {
@@ -294,7 +549,15 @@ int msg_SetXmailer( KMsg msg, const char * xmailer )
 
 #define ENCODED_BLK_SIZE    45
 
-static string encodeb64( const char * prefix, const char * value )
+/*
+ * SMTPUTF8 transport: UTF-8 header values go as they are (RFC 6532).
+ */
+static int rawUtf8( KMsg msg )
+{
+    return msg->utf8 && isUtf8Cs( msg->charset );
+}
+
+string msg_EncodeB64( const char * prefix, const char * value )
 {
     string encoded = snew();
     size_t size = strlen( value );
@@ -336,18 +599,18 @@ static string encodeb64( const char * prefix, const char * value )
     return encoded;
 }
 
-static int makeEncodedHeader( KMsg msg, const char * title, const char * value,
+int msg_EncodeHeader( KMsg msg, const char * title, const char * value,
         string headers )
 {
     if( !xscatc( headers, title, ": ", NULL ) ) return 0;
 
-    if( isUsAscii( value ) )
+    if( isUsAscii( value ) || rawUtf8( msg ) )
     {
         if( !scatc( headers, value ) ) return 0;
     }
     else
     {
-        string b64 = encodeb64( msg->cprefix, value );
+        string b64 = msg_EncodeB64( msg->cprefix, value );
         if( !b64 ) return 0;
         if( !scat( headers, b64 ) )
         {
@@ -367,7 +630,7 @@ static string makeEmail( KMsg msg, Pair a )
 
     if( A_NAME(a) )
     {
-        if( isUsAscii( A_NAME(a) ) )
+        if( isUsAscii( A_NAME(a) ) || rawUtf8( msg ) )
         {
             if( !sprint( buf, "%s <%s>", A_NAME(a), A_EMAIL(a) ) )
             {
@@ -377,7 +640,7 @@ static string makeEmail( KMsg msg, Pair a )
         }
         else
         {
-            string b64 = encodeb64( msg->cprefix, A_NAME(a) );
+            string b64 = msg_EncodeB64( msg->cprefix, A_NAME(a) );
             if( !b64 )
             {
                 sdel( buf );
@@ -437,164 +700,394 @@ static int makeAddr( KMsg msg, Pair a, string out )
     return 1;
 }
 
-static int makeAddrList( KMsg msg, const char * title, List list, string out )
+int msg_EncodeAddrList( KMsg msg, const char * title, RcptKind kind,
+        string out )
 {
-    Pair a;
+    Rcpt rcpt = rcpt_First( msg->rcpts, kind );
 
-    if( !list || !list->size ) return 1;
+    if( !rcpt ) return 1;
     if( !xscatc( out, title, ": ", NULL ) ) return 0;
 
-    a = lfirst( list );
-    while( a )
+    while( rcpt )
     {
-        if( !makeAddr( msg, a, out ) ) return 0;
-        a = lnext( list );
-        if( !scatc( out, a ? "," : "\r\n" ) ) return 0;
+        if( !makeAddr( msg, rcpt->addr, out ) ) return 0;
+        rcpt = rcpt->next;
+        if( !scatc( out, rcpt ? "," : "\r\n" ) ) return 0;
     }
     return 1;
 }
 
-static int makeDateHeader( string out )
+/*
+ * RFC 5322 date with a numeric zone, formatted at most once a second per
+ * thread; English names whatever the locale is.
+ */
+static const char * makeDate( void )
+{
+    static const char days[][4] =
+    { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char months[][4] =
+    { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct",
+            "Nov", "Dec" };
+    static __thread time_t date_time;
+    static __thread char date_buf[64];
+    time_t now = time( NULL );
+
+    if( now != date_time || !*date_buf )
+    {
+        struct tm lt;
+        int off;
+
+        localtime_r( &now, &lt );
+        off = (int)(lt.tm_gmtoff / 60);
+        snprintf( date_buf, sizeof(date_buf),
+                "%s, %02d %s %04d %02d:%02d:%02d %c%02d%02d",
+                days[lt.tm_wday], lt.tm_mday, months[lt.tm_mon],
+                lt.tm_year + 1900, lt.tm_hour, lt.tm_min, lt.tm_sec,
+                off < 0 ? '-' : '+', abs( off ) / 60, abs( off ) % 60 );
+        date_time = now;
+    }
+    return date_buf;
+}
+
+static size_t msgid_seq;
+static pthread_once_t msgid_once = PTHREAD_ONCE_INIT;
+static char msgid_host[256];
+static unsigned long msgid_pid;
+
+static void msgidInit( void )
+{
+    if( gethostname( msgid_host, sizeof(msgid_host) - 1 ) || !*msgid_host )
+    {
+        strcpy( msgid_host, "localhost" );
+    }
+    msgid_pid = (unsigned long)getpid();
+}
+
+/*
+ * <time.sequence.pid.random@domain>: the process-wide sequence is unique
+ * within a second, pid and random bits across processes and hosts. The
+ * domain is the sender's, the host name if there is no sender yet.
+ */
+static void makeMessageId( KMsg msg )
 {
-    time_t set_time;
-    struct tm *lt;
-    char buf[128];
+    const char * domain = NULL;
 
-    set_time = time( &set_time );
-    lt = localtime( &set_time );
-    strftime( buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S %Z", lt );
+    pthread_once( &msgid_once, msgidInit );
+    if( msg->from && A_EMAIL(msg->from) )
+    {
+        domain = strrchr( A_EMAIL(msg->from), '@' );
+        if( domain && *++domain == 0 ) domain = NULL;
+    }
+    snprintf( msg->msgid, sizeof(msg->msgid), "<%llx.%zx.%lx.%08llx@%s>",
+            (unsigned long long)time( NULL ),
+            __sync_add_and_fetch( &msgid_seq, 1 ), msgid_pid,
+            mime_Random() & 0xffffffffULL, domain ? domain : msgid_host );
+}
 
-    return xscatc( out, "Date: ", buf, "\r\n", NULL ) != NULL;
+static char * makeBoundary( KMsg msg, char * boundary, int idx )
+{
+    if( msg->frozen ) return strcpy( boundary, msg->boundary[idx] );
+    return mimeMakeBoundary( boundary );
 }
 
 static int makeExtraHeaders( KMsg msg, string out )
 {
     Pair header = lfirst( msg->headers );
+    msg->own_id = msg->own_mime = 0;
     while( header )
     {
-        if( !makeEncodedHeader( msg, H_NAME(header), H_VALUE(header), out ) ) return 0;
+        if( !strcasecmp( H_NAME(header), "Message-ID" ) ) msg->own_id = 1;
+        else if( !strcasecmp( H_NAME(header), "MIME-Version" ) ) msg->own_mime = 1;
+        if( !msg_EncodeHeader( msg, H_NAME(header), H_VALUE(header), out ) ) return 0;
         header = lnext( msg->headers );
     }
     return 1;
 }
 
-string msg_CreateHeaders( KMsg msg )
+static int makeSection( KMsg msg, int section, string out )
 {
-    string headers = snew();
-
-    if( !headers || !makeEncodedHeader( msg, "Subject", msg->subject, headers )
-            || !makeOneAddr( msg, "From", msg->from, headers )
-            || !makeOneAddr( msg, "Reply-To", msg->replyto, headers )
-            || !makeAddrList( msg, "To", msg->to, headers )
-            || !makeAddrList( msg, "Cc", msg->cc, headers )
-            || !makeAddrList( msg, "Bcc", msg->bcc, headers )
-            || !makeDateHeader( headers ) || !makeExtraHeaders( msg, headers ) )
+    switch( section )
     {
-        sdel( headers );
-        return NULL;
+        case MSG_H_SUBJECT:
+            return msg_EncodeHeader( msg, "Subject", msg->subject, out );
+        case MSG_H_ADDR:
+            return makeOneAddr( msg, "From", msg->from, out )
+                    && makeOneAddr( msg, "Reply-To", msg->replyto, out );
+        case MSG_H_RCPT:
+            return msg_EncodeAddrList( msg, "To", RCPT_TO, out )
+                    && msg_EncodeAddrList( msg, "Cc", RCPT_CC, out );
+        default:
+            return makeExtraHeaders( msg, out );
     }
-    return headers;
 }
 
-string msg_CreateBody( KMsg msg )
+/*
+ * Encodes dirty sections again, a failed one stays dirty.
+ */
+static int refreshHeaders( KMsg msg )
 {
-    TextPart part = lfirst( msg->parts );
-    char boundary[36];
-    int rc = 1;
-    string parts = snew();
-    if( !parts ) return NULL;
+    int i;
 
-    if( msg->parts->size > 1 )
+    if( msg->hutf8 != rawUtf8( msg ) )
     {
-        mimeMakeBoundary( boundary );
-        if( !scpyc( parts, "Content-Type: multipart/alternative; boundary=\"" )
-                || !xscatc( parts, boundary, "\"\r\n\r\n", NULL ) )
-        {
-            sdel( parts );
-            return NULL;
-        }
+        msg->hutf8 = rawUtf8( msg );
+        msg->dirty = MSG_D_ALL;
     }
-
-    while( part )
+    for( i = 0; i < MSG_H_SECTIONS; i++ )
     {
-        if( msg->parts->size > 1 )
-        {
-            if( !xscatc( parts, "--", boundary, "\r\nContent-ID: text@part\r\n",
-            NULL ) )
-            {
-                rc = 0;
-                break;
-            }
-        }
-        if( *part->cprefix )
-        {
-            string b64 = base64_sencode( part->body );
-            if( !b64
-                    || !xscatc( parts, "Content-Type: text/", part->ctype,
-                            "; charset=", part->charset,
-                            "\r\nContent-Disposition: inline\r\n"
-                                    "Content-Transfer-Encoding: base64\r\n\r\n",
-                            sstr( b64 ), "\r\n\r\n", NULL ) )
-            {
-                sdel( b64 );
-                rc = 0;
-                break;
-            }
-            sdel( b64 );
-        }
-        else
+        string section;
+
+        if( !(msg->dirty & (1U << i)) ) continue;
+        section = snew();
+        if( !section || !makeSection( msg, i, section ) )
         {
-            if( !xscatc( parts, "Content-Type: text/", part->ctype,
-                    "; charset=", part->charset, "\r\n\r\n", part->body,
-                    "\r\n\r\n", NULL ) )
-            {
-                rc = 0;
-                break;
-            }
+            sdel( section );
+            return 0;
         }
-        part = lnext( msg->parts );
-    }
-    if( rc )
-    {
-        if( msg->parts->size > 1 )
+        if( msg->hcache[i] )
         {
-            if( !xscatc( parts, "--", boundary, "--\r\n", NULL ) )
-            {
-                rc = 0;
-            }
+            KMEM_CHARGE( -(ssize_t)slen( msg->hcache[i] ) );
+            sdel( msg->hcache[i] );
         }
+        msg->hcache[i] = section;
+        KMEM_CHARGE( slen( section ) );
+        msg->dirty &= ~(1U << i);
     }
-    if( !rc )
+    return 1;
+}
+
+static int writeStr( MsgWriter writer, void * ctx, const char * s )
+{
+    return writer( ctx, s, strlen( s ) );
+}
+
+static int writeSection( MsgWriter writer, void * ctx, string section )
+{
+    return !slen( section ) || writer( ctx, sstr( section ), slen( section ) );
+}
+
+/*
+ * Date, Message-ID and MIME-Version come from static or per-thread buffers,
+ * nothing is allocated for them.
+ */
+static int writeStdHeaders( KMsg msg, MsgWriter writer, void * ctx )
+{
+    if( !writeStr( writer, ctx, "Date: " )
+            || !writeStr( writer, ctx, msg->frozen ? msg->date : makeDate() )
+            || !writeStr( writer, ctx, "\r\n" ) ) return 0;
+    if( !msg->own_id )
     {
-        sdel( parts );
-        return NULL;
+        if( !*msg->msgid ) makeMessageId( msg );
+        if( !writeStr( writer, ctx, "Message-ID: " )
+                || !writeStr( writer, ctx, msg->msgid )
+                || !writeStr( writer, ctx, "\r\n" ) ) return 0;
     }
-    return parts;
+    return msg->own_mime || writeStr( writer, ctx, "MIME-Version: 1.0\r\n" );
 }
 
-int msg_CreateFile( KMsg msg, MFile file, string error, const char * boundary,
-        const char * name, const char * ctype, const char * disposition,
-        const char * cid )
+static int writeHeaders( KMsg msg, MsgWriter writer, void * ctx )
+{
+    return refreshHeaders( msg )
+            && writeSection( writer, ctx, msg->hcache[MSG_H_SUBJECT] )
+            && writeSection( writer, ctx, msg->hcache[MSG_H_ADDR] )
+            && writeSection( writer, ctx, msg->hcache[MSG_H_RCPT] )
+            && writeStdHeaders( msg, writer, ctx )
+            && writeSection( writer, ctx, msg->hcache[MSG_H_EXTRA] );
+}
+
+static int writeBoundary( MsgWriter writer, void * ctx, const char * boundary,
+        const char * tail )
 {
-    FILE * f;
-    string mime_name;
-    const char * mime_type = getMimeType( name, ctype );
+    return writeStr( writer, ctx, "--" ) && writeStr( writer, ctx, boundary )
+            && writeStr( writer, ctx, tail );
+}
 
-    f = fopen( name, "rb" );
-    if( !f )
+static int stringWriter( void * ctx, const char * buf, size_t size )
+{
+    char chunk[4096];
+    while( size )
     {
-        sprint( error, "msg_CreateFile(\"%s\") : %s", name, strerror( errno ) );
-        return 0;
+        size_t n = size < sizeof(chunk) - 1 ? size : sizeof(chunk) - 1;
+        memcpy( chunk, buf, n );
+        chunk[n] = 0;
+        if( !scatc( (string)ctx, chunk ) ) return 0;
+        buf += n;
+        size -= n;
     }
-    mime_name = mimeFileName( name, *msg->cprefix ? msg->charset : NULL );
-    if( !mime_name )
-    {
-        fclose( f );
-        sprint( error, "msg_CreateFile(\"%s\"), internal error [2]", name );
+    return 1;
+}
+
+string msg_CreateHeaders( KMsg msg )
+{
+    KMEM_SCOPE( &msg->mem );
+    string headers = snew();
+
+    if( !headers || !writeHeaders( msg, stringWriter, headers ) )
+    {
+        sdel( headers );
+        return NULL;
+    }
+    return headers;
+}
+
+/*
+ * Size-only pass (msg->measure): counting writer gets the encoded size
+ * without data.
+ */
+static int skipEncoded( MsgWriter writer, void * ctx, size_t size )
+{
+    return writer( ctx, NULL, b64_EncodedSize( size ) );
+}
+
+/*
+ * 8bit body (RFC 6152): no NUL and lines up to 998 octets.
+ */
+static int scan8bit( TextPart part )
+{
+    const char * ptr = part->data;
+    const char * end = part->data + part->size;
+
+    if( memchr( ptr, 0, part->size ) ) return 0;
+    while( ptr < end )
+    {
+        const char * nl = memchr( ptr, '\n', end - ptr );
+        size_t line = (nl ? nl : end) - ptr;
+        if( line && ptr[line - 1] == '\r' ) line--;
+        if( line > 998 ) return 0;
+        if( !nl ) break;
+        ptr = nl + 1;
+    }
+    return 1;
+}
+
+static int fits8bit( TextPart part )
+{
+    if( part->fits < 0 ) part->fits = scan8bit( part );
+    return part->fits;
+}
+
+static int partWriter( void * ctx, const char * buf, size_t size )
+{
+    TextPart part = (TextPart)ctx;
+    if( part->esize + size > b64_EncodedSize( part->size ) ) return 0;
+    memcpy( part->encoded + part->esize, buf, size );
+    part->esize += size;
+    return 1;
+}
+
+/*
+ * Base64 body is encoded once, its size is known in advance.
+ */
+static int encodePart( TextPart part )
+{
+    B64Stream b64;
+
+    part->esize = 0;
+    part->encoded = Malloc( b64_EncodedSize( part->size ) + 1 );
+    if( !part->encoded ) return 0;
+    b64_StreamInit( &b64, partWriter, part );
+    if( !b64_StreamWrite( &b64, part->data, part->size )
+            || !b64_StreamEnd( &b64 ) )
+    {
+        Free( part->encoded );
+        part->encoded = NULL;
         return 0;
     }
+    return 1;
+}
+
+/*
+ * Text parts are written straight from the caller's (or shared) memory,
+ * base64 from the part's cache.
+ */
+static int writeBody( KMsg msg, MsgWriter writer, void * ctx )
+{
+    TextPart part = lfirst( msg->parts );
+    char boundary[36];
 
-    if( !sprint( file->headers, "\r\n--%s\r\n"
+    if( msg->parts->size > 1 )
+    {
+        makeBoundary( msg, boundary, MSG_B_ALT );
+        if( !writeStr( writer, ctx,
+                "Content-Type: multipart/alternative; boundary=\"" )
+                || !writeStr( writer, ctx, boundary )
+                || !writeStr( writer, ctx, "\"\r\n\r\n" ) ) return 0;
+    }
+
+    while( part )
+    {
+        if( msg->parts->size > 1 )
+        {
+            if( !writeBoundary( writer, ctx, boundary,
+                    "\r\nContent-ID: text@part\r\n" ) ) return 0;
+        }
+        if( !writeStr( writer, ctx, "Content-Type: text/" )
+                || !writeStr( writer, ctx, part->ctype )
+                || !writeStr( writer, ctx, "; charset=" )
+                || !writeStr( writer, ctx, part->charset ) ) return 0;
+        if( *part->cprefix && msg->eightbit && fits8bit( part ) )
+        {
+            if( !writeStr( writer, ctx, "\r\nContent-Disposition: inline\r\n"
+                    "Content-Transfer-Encoding: 8bit\r\n\r\n" )
+                    || !writer( ctx, part->data, part->size ) ) return 0;
+        }
+        else if( *part->cprefix )
+        {
+            if( !writeStr( writer, ctx, "\r\nContent-Disposition: inline\r\n"
+                    "Content-Transfer-Encoding: base64\r\n\r\n" ) ) return 0;
+            if( !part->encoded && !msg->measure && !encodePart( part ) ) return 0;
+            if( !part->encoded )
+            {
+                if( !skipEncoded( writer, ctx, part->size ) ) return 0;
+            }
+            else if( part->esize && !writer( ctx, part->encoded, part->esize ) ) return 0;
+        }
+        else
+        {
+            if( !writeStr( writer, ctx, "\r\n\r\n" )
+                    || !writer( ctx, part->data, part->size ) ) return 0;
+        }
+        if( !writeStr( writer, ctx, "\r\n\r\n" ) ) return 0;
+        part = lnext( msg->parts );
+    }
+
+    if( msg->parts->size > 1 )
+    {
+        if( !writeBoundary( writer, ctx, boundary, "--\r\n" ) ) return 0;
+    }
+    return 1;
+}
+
+string msg_CreateBody( KMsg msg )
+{
+    KMEM_SCOPE( &msg->mem );
+    string parts = snew();
+    if( !parts ) return NULL;
+    if( !writeBody( msg, stringWriter, parts ) )
+    {
+        sdel( parts );
+        return NULL;
+    }
+    return parts;
+}
+
+static int makeFileHeaders( KMsg msg, string headers, string error,
+        const char * boundary, EFile file, const char * disposition )
+{
+    const char * cid = *file->cid ? file->cid : NULL;
+    const char * mime_type = file->zip == ZIP_GZIP ? "application/gzip" :
+            file->zip == ZIP_ZIP ? "application/zip" :
+                    getMimeType( file->name, file->ctype );
+    string mime_name = mimeFileName( file->zname ? file->zname : file->name,
+            *msg->cprefix && !rawUtf8( msg ) ? msg->charset : NULL );
+    if( !mime_name )
+    {
+        sprint( error, "msg_CreateFile(\"%s\"), internal error [2]",
+                file->name );
+        return 0;
+    }
+
+    if( !sprint( headers, "\r\n--%s\r\n"
             "Content-Transfer-Encoding: base64\r\n"
             "Content-Type: %s; name=\"%s\"\r\n"
             "Content-Disposition: %s; filename=\"%s\"\r\n"
@@ -603,22 +1096,753 @@ int msg_CreateFile( KMsg msg, MFile file, string error, const char * boundary,
             sstr( mime_name ), cid ? "Content-ID: <" : "", cid ? cid : "",
             cid ? ">\r\n" : "" ) )
     {
-        fclose( f );
         sdel( mime_name );
-        sprint( error, "msg_CreateFile(\"%s\"), internal error [3]", name );
+        sprint( error, "msg_CreateFile(\"%s\"), internal error [3]",
+                file->name );
         return 0;
     }
+    sdel( mime_name );
+    return 1;
+}
 
+static int b64Writer( void * ctx, const char * buf, size_t size )
+{
+    return b64_StreamWrite( (B64Stream *)ctx, buf, size );
+}
+
+/*
+ * Every source type goes through the same streaming encoder, compressed
+ * files through deflate first.
+ */
+static int encodeFile( EFile file, B64Stream * b64, string error )
+{
+    char buf[48 * 1024];
+    const char * data;
+    KReader f;
+    long readed = 0;
+    int rc = 1;
+    ZipStream * zs = NULL;
+    MimeWriter put = b64Writer;
+    void * pctx = b64;
+
+    if( file->zip )
+    {
+        zs = Malloc( sizeof(ZipStream) );
+        if( !zs || !zip_Init( zs, file->zip, baseName( file->name ),
+                b64Writer, b64 ) )
+        {
+            Free( zs );
+            sprint( error, "msg_CreateFile(\"%s\") : compression error",
+                    file->name );
+            return 0;
+        }
+        put = zip_Write;
+        pctx = zs;
+    }
+
+    switch( file->type )
+    {
+        case MSRC_BUFFER:
+            rc = put( pctx, file->data, file->size );
+            break;
+        case MSRC_SHARED:
+            rc = put( pctx, file->shared->data, file->shared->size );
+            break;
+        case MSRC_PULL:
+            while( rc && (readed = file->pull( file->pull_ctx, buf,
+                    sizeof(buf) )) > 0 )
+            {
+                rc = put( pctx, buf, (size_t)readed );
+            }
+            if( rc && readed < 0 )
+            {
+                sprint( error, "msg_CreateFile(\"%s\") : read error",
+                        file->name );
+                rc = 0;
+            }
+            break;
+        default:
+            f = kio_Open( file->name );
+            if( !f )
+            {
+                sprint( error, "msg_CreateFile(\"%s\") : %s", file->name,
+                        strerror( errno ) );
+                rc = 0;
+                break;
+            }
+            while( rc && (readed = kio_Read( f, &data )) > 0 )
+            {
+                rc = put( pctx, data, (size_t)readed );
+            }
+            if( rc && readed < 0 )
+            {
+                sprint( error, "msg_CreateFile(\"%s\") : %s", file->name,
+                        strerror( errno ) );
+                rc = 0;
+            }
+            kio_Close( f );
+            break;
+    }
+
+    if( zs )
+    {
+        if( !zip_End( zs, rc ) && rc )
+        {
+            sprint( error, "msg_CreateFile(\"%s\") : compression error",
+                    file->name );
+            rc = 0;
+        }
+        Free( zs );
+    }
+    return rc && b64_StreamEnd( b64 );
+}
+
+static int createMFile( KMsg msg, MFile mfile, string error,
+        const char * boundary, EFile file, const char * disposition )
+{
+    B64Stream b64;
+
+    if( !makeFileHeaders( msg, mfile->headers, error, boundary, file,
+            disposition ) ) return 0;
+    sdel( mfile->body );
+    mfile->body = snew();
+    if( !mfile->body )
+    {
+        sprint( error, "msg_CreateFile(\"%s\"), internal error [4]",
+                file->name );
+        return 0;
+    }
+    b64_StreamInit( &b64, stringWriter, mfile->body );
+    if( !encodeFile( file, &b64, error ) )
+    {
+        if( !slen( error ) ) sprint( error,
+                "msg_CreateFile(\"%s\"), internal error [4]", file->name );
+        return 0;
+    }
+    return 1;
+}
+
+int msg_CreateFile( KMsg msg, MFile file, string error, const char * boundary,
+        const char * name, const char * ctype, const char * disposition,
+        const char * cid )
+{
+    KMEM_SCOPE( &msg->mem );
+    struct _EFile efile;
+    memset( &efile, 0, sizeof(efile) );
+    efile.type = MSRC_FILE;
+    efile.name = (char *)name;
+    efile.ctype = (char *)ctype;
+    if( cid ) snprintf( efile.cid, sizeof(efile.cid), "%s", cid );
+    return createMFile( msg, file, error, boundary, &efile, disposition );
+}
+
+static int delMFile( MFile file )
+{
     sdel( file->body );
-    file->body = base64_fencode( f );
-    if( !file->body )
+    sdel( file->headers );
+    return 0;
+}
+
+static void delCachedFile( void * ptr )
+{
+    MFile file = (MFile)ptr;
+    delMFile( file );
+    Free( file );
+}
+
+/*
+ * Encoded files live in stringlib buffers, the wrappers do not see them.
+ */
+static int addCachedFile( KMsg msg, MFile file )
+{
+    size_t size = slen( file->headers ) + slen( file->body );
+    if( !ladd( msg->fcache, file ) ) return 0;
+    msg->fbytes += size;
+    KMEM_CHARGE( size );
+    return 1;
+}
+
+/*
+ * Frozen message keeps encoded files, in output order, for the next pass.
+ */
+static MFile cachedFile( KMsg msg, string error, const char * boundary,
+        EFile efile, const char * disposition )
+{
+    MFile file;
+
+    if( msg->fcached )
     {
-        fclose( f );
-        sdel( mime_name );
-        sprint( error, "msg_CreateFile(\"%s\"), internal error [4]", name );
+        file = msg->fpos++ ? lnext( msg->fcache ) : lfirst( msg->fcache );
+        if( !file ) sprint( error, "msg_Write(\"%s\"), internal error",
+                efile->name );
+        return file;
+    }
+
+    file = Calloc( sizeof(struct _MFile), 1 );
+    if( !file || !(file->headers = snew())
+            || !createMFile( msg, file, error, boundary, efile, disposition )
+            || !addCachedFile( msg, file ) )
+    {
+        if( file ) delCachedFile( file );
+        return NULL;
+    }
+    return file;
+}
+
+/*
+ * Raw file size, (size_t)-1 if it is not known before reading (also for
+ * compressed files).
+ */
+static size_t fileSize( EFile file )
+{
+    struct stat st;
+
+    if( file->zip ) return (size_t)-1;
+    switch( file->type )
+    {
+        case MSRC_BUFFER:
+            return file->size;
+        case MSRC_SHARED:
+            return file->shared->size;
+        case MSRC_PULL:
+            return (size_t)-1;
+        default:
+            if( stat( file->name, &st ) || !S_ISREG( st.st_mode ) ) return (size_t)-1;
+            return (size_t)st.st_size;
+    }
+}
+
+static int writeFile( KMsg msg, string headers, MsgWriter writer, void * ctx,
+        string error, const char * boundary, EFile efile,
+        const char * disposition )
+{
+    B64Stream b64;
+
+    if( msg->measure )
+    {
+        size_t size = fileSize( efile );
+        return size != (size_t)-1
+                && makeFileHeaders( msg, headers, error, boundary, efile,
+                        disposition )
+                && writer( ctx, sstr( headers ), slen( headers ) )
+                && skipEncoded( writer, ctx, size )
+                && writeStr( writer, ctx, "\r\n" );
+    }
+
+    if( msg->frozen )
+    {
+        MFile file = cachedFile( msg, error, boundary, efile, disposition );
+        return file && writer( ctx, sstr( file->headers ), slen( file->headers ) )
+                && writer( ctx, sstr( file->body ), slen( file->body ) )
+                && writeStr( writer, ctx, "\r\n" );
+    }
+
+    if( !makeFileHeaders( msg, headers, error, boundary, efile, disposition )
+            || !writer( ctx, sstr( headers ), slen( headers ) ) ) return 0;
+    b64_StreamInit( &b64, writer, ctx );
+    return encodeFile( efile, &b64, error ) && writeStr( writer, ctx, "\r\n" );
+}
+
+static int pipeProduce( void * item, PipeWriter writer, void * wctx,
+        string error )
+{
+    B64Stream b64;
+    b64_StreamInit( &b64, writer, wctx );
+    return encodeFile( (EFile)item, &b64, error );
+}
+
+typedef struct _TeeCtx
+{
+    MsgWriter writer;
+    void * ctx;
+    string body;
+} TeeCtx;
+
+static int teeWriter( void * ctx, const char * buf, size_t size )
+{
+    TeeCtx * tee = (TeeCtx *)ctx;
+    return stringWriter( tee->body, buf, size )
+            && tee->writer( tee->ctx, buf, size );
+}
+
+/*
+ * Headers are made here, the body comes from the pipe. A frozen message
+ * also keeps the encoded file in its cache.
+ */
+static int drainFile( KMsg msg, KPipe pipe, size_t idx, string headers,
+        MsgWriter writer, void * ctx, string error, const char * boundary,
+        EFile efile, const char * disposition )
+{
+    TeeCtx tee;
+    MFile file = NULL;
+    int rc;
+
+    if( msg->frozen )
+    {
+        file = Calloc( sizeof(struct _MFile), 1 );
+        if( !file || !(file->headers = snew()) || !(file->body = snew()) )
+        {
+            if( file ) delCachedFile( file );
+            return 0;
+        }
+        headers = file->headers;
+    }
+
+    rc = makeFileHeaders( msg, headers, error, boundary, efile, disposition )
+            && writer( ctx, sstr( headers ), slen( headers ) );
+    if( rc && file )
+    {
+        tee.writer = writer;
+        tee.ctx = ctx;
+        tee.body = file->body;
+        rc = kpipe_Drain( pipe, idx, teeWriter, &tee, error );
+    }
+    else if( rc ) rc = kpipe_Drain( pipe, idx, writer, ctx, error );
+    rc = rc && writeStr( writer, ctx, "\r\n" );
+
+    if( file && (!rc || !addCachedFile( msg, file )) )
+    {
+        delCachedFile( file );
+        rc = 0;
+    }
+    return rc;
+}
+
+/*
+ * Files are encoded by the pool's threads while the writer sends
+ * already encoded data, in MIME order.
+ */
+static int writePiped( KMsg msg, List files, MsgWriter writer, void * ctx,
+        string error, const char * boundary, const char * disposition )
+{
+    int rc = 1;
+    size_t i;
+    KPipe pipe;
+    EFile * items;
+    string headers;
+
+    items = Malloc( sizeof(EFile) * files->size );
+    if( !items ) return -1;
+    items[0] = lfirst( files );
+    for( i = 1; i < files->size; i++ )
+        items[i] = lnext( files );
+    pipe = kpipe_Start( msg->pool, (void **)items, files->size,
+            pipeProduce );
+    if( !pipe )
+    {
+        Free( items );
+        return -1;
+    }
+
+    headers = snew();
+    if( !headers ) rc = 0;
+    for( i = 0; rc && i < files->size; i++ )
+    {
+        rc = drainFile( msg, pipe, i, headers, writer, ctx, error, boundary,
+                items[i], disposition );
+    }
+    kpipe_Stop( pipe );
+    sdel( headers );
+    Free( items );
+    return rc;
+}
+
+static int writeFiles( KMsg msg, List files, MsgWriter writer, void * ctx,
+        string error, const char * boundary, const char * disposition )
+{
+    int rc = 1;
+    EFile efile;
+    string headers;
+
+    if( msg->pool && files->size && !msg->measure && !msg->fcached )
+    {
+        rc = writePiped( msg, files, writer, ctx, error, boundary,
+                disposition );
+        if( rc >= 0 ) return rc;
+        rc = 1;
+    }
+
+    efile = lfirst( files );
+    headers = snew();
+    if( !headers ) return 0;
+
+    while( efile )
+    {
+        if( !writeFile( msg, headers, writer, ctx, error, boundary, efile,
+                disposition ) )
+        {
+            rc = 0;
+            break;
+        }
+        efile = lnext( files );
+    }
+    sdel( headers );
+    return rc;
+}
+
+static int writeRelated( KMsg msg, MsgWriter writer, void * ctx,
+        string error )
+{
+    char r_boundary[36];
+
+    makeBoundary( msg, r_boundary, MSG_B_REL );
+    return writeStr( writer, ctx,
+            "Content-Type: multipart/related; boundary=\"" )
+            && writeStr( writer, ctx, r_boundary )
+            && writeStr( writer, ctx, "\"\r\n\r\n" )
+            && writeBoundary( writer, ctx, r_boundary, "\r\n" )
+            && writeBody( msg, writer, ctx )
+            && writeFiles( msg, msg->efiles, writer, ctx, error, r_boundary,
+                    "inline" )
+            && writeBoundary( writer, ctx, r_boundary, "--\r\n" );
+}
+
+int msg_Write( KMsg msg, MsgWriter writer, void * ctx, string error )
+{
+    KMEM_SCOPE( &msg->mem );
+    int rc = 0;
+    char mp_boundary[36];
+
+    msg->fpos = 0;
+    if( !writeHeaders( msg, writer, ctx ) ) goto wend;
+
+    if( msg->afiles->size )
+    {
+        makeBoundary( msg, mp_boundary, MSG_B_MIX );
+        if( !writeStr( writer, ctx,
+                "Content-Type: multipart/mixed; boundary=\"" )
+                || !writeStr( writer, ctx, mp_boundary )
+                || !writeStr( writer, ctx, "\"\r\n\r\n" ) ) goto wend;
+        if( msg->parts->size || msg->efiles->size )
+        {
+            if( !writeBoundary( writer, ctx, mp_boundary, "\r\n" ) ) goto wend;
+            if( msg->efiles->size )
+            {
+                if( !writeRelated( msg, writer, ctx, error ) ) goto wend;
+            }
+            else if( !writeBody( msg, writer, ctx ) ) goto wend;
+        }
+        if( !writeFiles( msg, msg->afiles, writer, ctx, error, mp_boundary,
+                "attachment" )
+                || !writeBoundary( writer, ctx, mp_boundary, "--\r\n" ) ) goto wend;
+    }
+    else if( msg->efiles->size )
+    {
+        if( !writeRelated( msg, writer, ctx, error ) ) goto wend;
+    }
+    else if( !writeBody( msg, writer, ctx ) ) goto wend;
+
+    if( msg->frozen && !msg->measure ) msg->fcached = 1;
+    rc = 1;
+    wend: return rc;
+}
+
+/*
+ * Stuffed output goes on the wire as it is (KMAIL_PRESTUFFED), so it is
+ * made by the DATA filter and ends with CRLF.
+ */
+static int writeStuffed( KMsg msg, MsgWriter writer, void * ctx, int stuffed,
+        string error )
+{
+    DataFilter filter;
+
+    if( !stuffed ) return msg_Write( msg, writer, ctx, error );
+    filter_Init( &filter, FILTER_DATA, writer, ctx );
+    return msg_Write( msg, filter_Write, &filter, error )
+            && filter_End( &filter );
+}
+
+static int fileWriter( void * ctx, const char * buf, size_t size )
+{
+    return fwrite( buf, 1, size, (FILE *)ctx ) == size;
+}
+
+static int fdWriter( void * ctx, const char * buf, size_t size )
+{
+    int fd = *(int *)ctx;
+
+    while( size )
+    {
+        ssize_t written = write( fd, buf, size );
+        if( written < 0 )
+        {
+            if( errno == EINTR ) continue;
+            return 0;
+        }
+        buf += written;
+        size -= (size_t)written;
+    }
+    return 1;
+}
+
+int msg_WriteTo( KMsg msg, FILE * f, int stuffed, string error )
+{
+    KMEM_SCOPE( &msg->mem );
+    if( !writeStuffed( msg, fileWriter, f, stuffed, error ) || fflush( f ) )
+    {
+        if( !slen( error ) ) sprint( error, "msg_WriteTo() : %s",
+                strerror( errno ) );
         return 0;
     }
+    return 1;
+}
 
-    sdel( mime_name );
+int msg_WriteToFd( KMsg msg, int fd, int stuffed, string error )
+{
+    KMEM_SCOPE( &msg->mem );
+    if( !writeStuffed( msg, fdWriter, &fd, stuffed, error ) )
+    {
+        if( !slen( error ) ) sprint( error, "msg_WriteToFd() : %s",
+                strerror( errno ) );
+        return 0;
+    }
     return 1;
 }
+
+static int countWriter( void * ctx, const char * buf, size_t size )
+{
+    (void)buf;
+    *(size_t *)ctx += size;
+    return 1;
+}
+
+/*
+ * Exact message size without encoding anything, 0 if a source size can not
+ * be known in advance (pull callbacks, unreadable files).
+ */
+size_t msg_Size( KMsg msg )
+{
+    KMEM_SCOPE( &msg->mem );
+    size_t size = 0;
+    int rc;
+    string error = snew();
+    if( !error ) return 0;
+
+    msg->measure = 1;
+    rc = msg_Write( msg, countWriter, &size, error );
+    msg->measure = 0;
+    sdel( error );
+    return rc ? size : 0;
+}
+
+#ifndef KSMTP_MEMSTAT
+static size_t filesFootprint( List files )
+{
+    size_t size = 0;
+    EFile file;
+
+    for( file = lfirst( files ); file; file = lnext( files ) )
+    {
+        if( file->type == MSRC_BUFFER ) size += file->size;
+        else if( file->type == MSRC_SHARED ) size += file->shared->size;
+    }
+    return size;
+}
+#endif
+
+size_t msg_Footprint( KMsg msg )
+{
+#ifdef KSMTP_MEMSTAT
+    KMemStat stat;
+    kmem_Get( &msg->mem, &stat );
+    return stat.live > 0 ? (size_t)stat.live : 0;
+#else
+    size_t size = sizeof(struct _KMsg) + msg->fbytes;
+    TextPart part;
+    int i;
+
+    for( i = 0; i < MSG_H_SECTIONS; i++ )
+    {
+        if( msg->hcache[i] ) size += slen( msg->hcache[i] );
+    }
+    for( part = lfirst( msg->parts ); part; part = lnext( msg->parts ) )
+        size += part->size + part->esize;
+    return size + filesFootprint( msg->efiles )
+            + filesFootprint( msg->afiles );
+#endif
+}
+
+void msg_Invalidate( KMsg msg )
+{
+    KMEM_SCOPE( &msg->mem );
+    TextPart part;
+
+    dropHeaders( msg );
+    MSG_CHANGED( msg );
+    for( part = lfirst( msg->parts ); part; part = lnext( msg->parts ) )
+    {
+        Free( part->encoded );
+        part->encoded = NULL;
+        part->esize = 0;
+        part->fits = -1;
+    }
+}
+
+int msg_SetWorkers( KMsg msg, size_t workers )
+{
+    KPipePool pool = NULL;
+
+    if( workers && !(pool = kpipe_PoolCreate( workers )) ) return 0;
+    kpipe_PoolUnref( msg->pool );
+    msg->pool = pool;
+    return 1;
+}
+
+void msg_SetPool( KMsg msg, KPipePool pool )
+{
+    if( pool ) kpipe_PoolRef( pool );
+    kpipe_PoolUnref( msg->pool );
+    msg->pool = pool;
+}
+
+void msg_SetTransport( KMsg msg, int eightbit, int utf8 )
+{
+    msg->eightbit = eightbit;
+    msg->utf8 = utf8;
+}
+
+static int pairUtf8( Pair a )
+{
+    return a && ((A_NAME(a) && !isUsAscii( A_NAME(a) ))
+            || (A_EMAIL(a) && !isUsAscii( A_EMAIL(a) )));
+}
+
+/*
+ * Non-ASCII in header values or addresses, the envelope included.
+ */
+static int needsUtf8( KMsg msg )
+{
+    Pair header;
+    EFile file;
+    int kind;
+
+    if( (msg->subject && !isUsAscii( msg->subject )) || pairUtf8( msg->from )
+            || pairUtf8( msg->replyto ) ) return 1;
+    for( kind = 0; kind < RCPT_KINDS; kind++ )
+    {
+        Rcpt rcpt = rcpt_First( msg->rcpts, kind );
+        for( ; rcpt; rcpt = rcpt->next )
+            if( pairUtf8( rcpt->addr ) ) return 1;
+    }
+    for( header = lfirst( msg->headers ); header;
+            header = lnext( msg->headers ) )
+        if( !isUsAscii( H_VALUE(header) ) ) return 1;
+    for( file = lfirst( msg->afiles ); file; file = lnext( msg->afiles ) )
+        if( !isUsAscii( file->name ) ) return 1;
+    for( file = lfirst( msg->efiles ); file; file = lnext( msg->efiles ) )
+        if( !isUsAscii( file->name ) ) return 1;
+    return 0;
+}
+
+/*
+ * MSG_NEEDS_* of the message as msg_Write() would produce it now.
+ */
+int msg_Needs( KMsg msg )
+{
+    int needs = 0;
+    TextPart part;
+
+    if( msg->eightbit )
+    {
+        for( part = lfirst( msg->parts ); part; part = lnext( msg->parts ) )
+        {
+            if( *part->cprefix && fits8bit( part ) )
+            {
+                needs |= MSG_NEEDS_8BIT;
+                break;
+            }
+        }
+    }
+    if( rawUtf8( msg ) && needsUtf8( msg ) ) needs |= MSG_NEEDS_UTF8;
+    return needs;
+}
+
+int msg_Freeze( KMsg msg )
+{
+    KMEM_SCOPE( &msg->mem );
+    msg_Unfreeze( msg );
+    msg->fcache = lcreate( delCachedFile );
+    if( !msg->fcache ) return 0;
+    strcpy( msg->date, makeDate() );
+    mimeMakeBoundary( msg->boundary[MSG_B_ALT] );
+    mimeMakeBoundary( msg->boundary[MSG_B_REL] );
+    mimeMakeBoundary( msg->boundary[MSG_B_MIX] );
+    msg->fcached = 0;
+    msg->frozen = 1;
+    return 1;
+}
+
+void msg_Unfreeze( KMsg msg )
+{
+    KMEM_SCOPE( &msg->mem );
+    if( msg->fcache ) ldestroy( msg->fcache );
+    KMEM_CHARGE( -(ssize_t)msg->fbytes );
+    msg->fbytes = 0;
+    msg->fcache = NULL;
+    msg->fcached = 0;
+    msg->frozen = 0;
+}
+
+static int prepWriter( void * ctx, const char * buf, size_t size )
+{
+    KPrepared prep = (KPrepared)ctx;
+    if( prep->size + size > prep->bsize )
+    {
+        size_t bsize = prep->bsize ? prep->bsize : 4096;
+        char * data;
+        while( bsize < prep->size + size )
+            bsize *= 2;
+        data = Realloc( prep->data, bsize );
+        if( !data ) return 0;
+        prep->data = data;
+        prep->bsize = bsize;
+    }
+    memcpy( prep->data + prep->size, buf, size );
+    prep->size += size;
+    return 1;
+}
+
+KPrepared msg_Prepare( KMsg msg, string error )
+{
+    KMEM_SCOPE( &msg->mem );
+    KPrepared prep;
+    DataFilter filter;
+
+    if( !msg->from || !A_EMAIL(msg->from) )
+    {
+        scpyc( error, "msg_Prepare(), no sender address" );
+        return NULL;
+    }
+    prep = Calloc( sizeof(struct _KPrepared), 1 );
+    if( !prep )
+    {
+        scpyc( error, "msg_Prepare(), internal error [1]" );
+        return NULL;
+    }
+    prep->from = Strdup( A_EMAIL(msg->from) );
+    if( !prep->from )
+    {
+        scpyc( error, "msg_Prepare(), internal error [2]" );
+        msg_DestroyPrepared( prep );
+        return NULL;
+    }
+    scpyc( error, "" );
+    prep->needs = msg_Needs( msg );
+    filter_Init( &filter, FILTER_CRLF | FILTER_LIMIT, prepWriter, prep );
+    if( !msg_Write( msg, filter_Write, &filter, error )
+            || !filter_End( &filter ) )
+    {
+        if( !slen( error ) ) scpyc( error, "msg_Prepare(), internal error [3]" );
+        msg_DestroyPrepared( prep );
+        return NULL;
+    }
+    return prep;
+}
+
+void msg_DestroyPrepared( KPrepared prep )
+{
+    if( !prep ) return;
+    Free( prep->data );
+    Free( prep->from );
+    Free( prep );
+}
@@ -10,6 +10,12 @@
 
 #include "../klib/plist.h"
 #include "../stringlib/stringlib.h"
+#include "rcpt.h"
+#include "kbuf.h"
+#include "kmem.h"
+#include "kzip.h"
+#include "kpipe.h"
+#include <stdio.h>
 
 #define KMSG_DEFAULT_CHARSET    "UTF-8"
 #define KFILE_CONTENT_ID        "file@"
@@ -34,17 +40,38 @@ typedef struct _AFile
 }*AFile;
 */
 
-#define F_NAME( pair )  (pair)->first
-#define F_CTYPE( pair ) (pair)->second
-
 #define H_NAME( pair )  (pair)->first
 #define H_VALUE( pair ) (pair)->second
 
+/*
+ * Pull source: fills up to 'size' bytes, returns 0 at the end, -1 on error.
+ * It is called again for every serialization of the message, from a worker
+ * thread when the message has a worker pool.
+ */
+typedef long (*MsgPull)( void * ctx, char * buf, size_t size );
+
+typedef enum _SourceType
+{
+    MSRC_FILE = 0, MSRC_BUFFER, MSRC_SHARED, MSRC_PULL
+} SourceType;
+
+/*
+ * Embedded (with cid) or attached file. MSRC_BUFFER data is borrowed and must
+ * outlive the message, MSRC_SHARED holds a reference.
+ */
 typedef struct _EFile
 {
     char * name;
     char * ctype;
     char cid[sizeof(KFILE_CONTENT_ID) * 2];
+    SourceType type;
+    const char * data;
+    size_t size;
+    KBuffer shared;
+    MsgPull pull;
+    void * pull_ctx;
+    ZipMethod zip;
+    char * zname;
 }*EFile;
 
 typedef struct _MFile
@@ -53,14 +80,72 @@ typedef struct _MFile
     string body;
 }*MFile;
 
+/*
+ * Text part body is written from 'data': an own copy ('body'), borrowed
+ * caller memory or a shared buffer.
+ */
 typedef struct _TextPart
 {
     char * body;
+    const char * data;
+    size_t size;
+    KBuffer shared;
     char * ctype;
     char charset[32];
     char cprefix[40];
+    /*
+     * fits8bit() result (-1 - not checked yet) and the base64 body, kept
+     * from the first pass that encoded it: borrowed data must not change
+     * while the part is in the message (or see msg_Invalidate()).
+     */
+    int fits;
+    char * encoded;
+    size_t esize;
 }*TextPart;
 
+/*
+ * Output sink for msg_Write(): must write all 'size' bytes, returns 0 on error.
+ */
+typedef int (*MsgWriter)( void * ctx, const char * buf, size_t size );
+
+/*
+ * Message serialized once (without Bcc), ready to be sent to any envelope.
+ * 'data' has CRLF line ends and no line over 998 octets, as DATA will
+ * carry it, so a DKIM signature over it holds. 'dkim': a DKIM-Signature
+ * is at the front of 'data'.
+ */
+typedef struct _KPrepared
+{
+    char * from;
+    char * data;
+    size_t size;
+    size_t bsize;
+    int needs;
+    int dkim;
+}*KPrepared;
+
+/*
+ * SMTP extensions the serialized message needs, see msg_Needs().
+ */
+#define MSG_NEEDS_8BIT  0x01
+#define MSG_NEEDS_UTF8  0x02
+
+#define MSG_B_ALT       0
+#define MSG_B_REL       1
+#define MSG_B_MIX       2
+
+/*
+ * Cached header sections, in output order (Date goes between RCPT and
+ * EXTRA). A setter marks its section dirty, only dirty sections are
+ * encoded again on the next msg_Write().
+ */
+#define MSG_H_SUBJECT   0
+#define MSG_H_ADDR      1
+#define MSG_H_RCPT      2
+#define MSG_H_EXTRA     3
+#define MSG_H_SECTIONS  4
+#define MSG_D_ALL       ((1U << MSG_H_SECTIONS) - 1)
+
 typedef struct _KMsg
 {
     char charset[32];
@@ -69,16 +154,65 @@ typedef struct _KMsg
     char *xmailer;
 
     size_t lastid;
-    PList afiles;
+    List afiles;
     List efiles;
     List parts;
     PList headers;
-    PList to;
-    PList cc;
-    PList bcc;
+    RcptSet rcpts;
     Pair from;
     Pair replyto;
 
+    /*
+     * Threads encoding attachments while the writer sends, NULL - encode
+     * sequentially in the caller's thread.
+     */
+    KPipePool pool;
+
+    /*
+     * Transport allows 8-bit text bodies (8BITMIME) and raw UTF-8 headers
+     * (SMTPUTF8), instead of base64 and RFC 2047 encoded-words.
+     */
+    int eightbit;
+    int utf8;
+
+    /*
+     * Frozen message: boundaries and Date are fixed and encoded files are
+     * cached, so msg_Write() produces the same bytes on every pass.
+     */
+    int frozen;
+    int measure;
+    int fcached;
+    size_t fpos;
+    List fcache;
+    char date[64];
+    char boundary[3][36];
+
+    /*
+     * Serialized header sections and MSG_H_* bits to rebuild; 'hutf8' is
+     * the raw UTF-8 mode they were made for.
+     */
+    string hcache[MSG_H_SECTIONS];
+    unsigned dirty;
+    int hutf8;
+
+    /*
+     * Message-ID made by the first write (empty - not yet). It is kept for
+     * passes over the unchanged message (DKIM, resends), any change to the
+     * message or msg_NewMessageId() drops it. 'own_id', 'own_mime': the
+     * caller added these headers itself, they are not generated.
+     */
+    char msgid[320];
+    int own_id;
+    int own_mime;
+
+    /*
+     * Memory allocated by the message's functions (KSMTP_MEMSTAT), the
+     * encoded file cache of a frozen message is in 'fbytes'. KPrepared
+     * data stays charged to the message that made it.
+     */
+    KMemStat mem;
+    size_t fbytes;
+
 }*KMsg;
 
 KMsg msg_Create( void );
@@ -90,8 +224,28 @@ int msg_SetReplyTo( KMsg msg, const char * rto );
 int msg_AddTo( KMsg msg, const char * to );
 int msg_AddCc( KMsg msg, const char * cc );
 int msg_AddBcc( KMsg msg, const char * bcc );
+int msg_RemoveRcpt( KMsg msg, const char * email );
 int msg_AttachFile( KMsg msg, const char * file, const char * ctype );
+int msg_AttachBuffer( KMsg msg, const char * name, const void * data,
+        size_t size, const char * ctype );
+int msg_AttachShared( KMsg msg, const char * name, KBuffer buf,
+        const char * ctype );
+int msg_AttachPull( KMsg msg, const char * name, MsgPull pull, void * ctx,
+        const char * ctype );
+/*
+ * Compressed while it is encoded: "name.gz" (application/gzip) or
+ * "name.zip" with one entry (application/zip).
+ */
+int msg_AttachFileZip( KMsg msg, const char * name, ZipMethod method );
+int msg_AttachBufferZip( KMsg msg, const char * name, const void * data,
+        size_t size, ZipMethod method );
 const char * msg_EmbedFile( KMsg msg, const char * file, const char * ctype );
+const char * msg_EmbedBuffer( KMsg msg, const char * name, const void * data,
+        size_t size, const char * ctype );
+const char * msg_EmbedShared( KMsg msg, const char * name, KBuffer buf,
+        const char * ctype );
+const char * msg_EmbedPull( KMsg msg, const char * name, MsgPull pull,
+        void * ctx, const char * ctype );
 
 void msg_ClearTo( KMsg msg );
 void msg_ClearCc( KMsg msg );
@@ -103,6 +257,11 @@ void msg_SetCharset( KMsg msg, const char * charset );
 
 int msg_SetXmailer( KMsg msg, const char * xmailer );
 int msg_AddHeader( KMsg msg, const char * key, const char * val );
+/*
+ * "Message-ID" is the generated one unless the caller added its own.
+ */
+const char * msg_GetHeader( KMsg msg, const char * key );
+void msg_NewMessageId( KMsg msg );
 void msg_ClearHeaders( KMsg msg );
 
 int msg_SetSubject( KMsg msg, const char * subj );
@@ -110,6 +269,10 @@ int msg_AddUtfTextPart( KMsg msg, const char * body, const char * ctype );
 int msg_AddDefTextPart( KMsg msg, const char * body, const char *ctype );
 int msg_AddTextPart( KMsg msg, const char * body, const char * ctype,
         const char * charset );
+int msg_AddTextPartRef( KMsg msg, const char * body, size_t size,
+        const char * ctype, const char * charset );
+int msg_AddSharedTextPart( KMsg msg, KBuffer body, const char * ctype,
+        const char * charset );
 
 string msg_CreateHeaders( KMsg msg );
 string msg_CreateBody( KMsg msg );
@@ -117,4 +280,38 @@ int msg_CreateFile( KMsg msg, MFile file, string error, const char * boundary,
         const char * name, const char * ctype, const char * disposition,
         const char * cid );
 
+/*
+ * Drops everything cached from the message's data, for callers that change
+ * borrowed text bodies or the KMsg fields directly.
+ */
+void msg_Invalidate( KMsg msg );
+/*
+ * msg_SetWorkers() starts an own pool of 'workers' threads (0 - none) that
+ * lives with the message, msg_SetPool() shares one, e.g. a KMail's.
+ */
+int msg_SetWorkers( KMsg msg, size_t workers );
+void msg_SetPool( KMsg msg, KPipePool pool );
+void msg_SetTransport( KMsg msg, int eightbit, int utf8 );
+int msg_Needs( KMsg msg );
+int msg_Freeze( KMsg msg );
+void msg_Unfreeze( KMsg msg );
+int msg_Write( KMsg msg, MsgWriter writer, void * ctx, string error );
+size_t msg_Size( KMsg msg );
+#define msg_MemStat( msg, out ) kmem_Get( &(msg)->mem, (out) )
+/*
+ * Bytes the message holds: accounted live bytes with KSMTP_MEMSTAT,
+ * otherwise the sizes of its text parts, buffers and caches, without
+ * reading or encoding anything. Files on disk are not counted.
+ */
+size_t msg_Footprint( KMsg msg );
+/*
+ * Complete message as .eml, streamed. 'stuffed': the file is in DATA form
+ * (see kfilter.h: CRLF line ends, long lines broken, dot-stuffed, a final
+ * CRLF), so mail_SendFromFile() with KMAIL_PRESTUFFED sends it as it is.
+ */
+int msg_WriteTo( KMsg msg, FILE * f, int stuffed, string error );
+int msg_WriteToFd( KMsg msg, int fd, int stuffed, string error );
+KPrepared msg_Prepare( KMsg msg, string error );
+void msg_DestroyPrepared( KPrepared prep );
+
 #endif /* KMSG_H_ */
@@ -0,0 +1,27 @@
+/*
+ * kmsg_int.h, part of "ksmtp" project.
+ *
+ *  Header builders shared between kmsg.c and bench.c, not a public API.
+ */
+
+#ifndef KMSG_INT_H_
+#define KMSG_INT_H_
+
+#include "kmsg.h"
+
+/*
+ * RFC 2047 'B' encoding of 'value', 'prefix' is "=?charset?B?".
+ */
+string msg_EncodeB64( const char * prefix, const char * value );
+/*
+ * Append "title: value\r\n", encoded when needed.
+ */
+int msg_EncodeHeader( KMsg msg, const char * title, const char * value,
+        string headers );
+/*
+ * Append "title: addr, addr...\r\n" for all recipients of 'kind'.
+ */
+int msg_EncodeAddrList( KMsg msg, const char * title, RcptKind kind,
+        string out );
+
+#endif /* KMSG_INT_H_ */
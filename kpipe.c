@@ -0,0 +1,317 @@
+/*
+ * kpipe.c, part of "ksmtp" project.
+ */
+
+#include "kpipe.h"
+
+#define SLOT( job, idx )    ((job)->slots + (idx) * (KPIPE_CHUNK_SIZE + 1))
+
+typedef struct _PipeCtx
+{
+    KPipe pipe;
+    PipeJob job;
+} PipeCtx;
+
+static int pipePublish( KPipe pipe, PipeJob job )
+{
+    SLOT( job, job->tail )[job->fill] = 0;
+    pthread_mutex_lock( &pipe->pool->lock );
+    job->sizes[job->tail] = job->fill;
+    job->tail = (job->tail + 1) % KPIPE_DEPTH;
+    job->count++;
+    job->fill = 0;
+    pthread_cond_broadcast( &pipe->produced );
+    pthread_mutex_unlock( &pipe->pool->lock );
+    return 1;
+}
+
+/*
+ * Producer side: blocks while the ring of the item is full.
+ */
+static int pipeWriter( void * ctx, const char * buf, size_t size )
+{
+    KPipe pipe = ((PipeCtx *)ctx)->pipe;
+    PipeJob job = ((PipeCtx *)ctx)->job;
+
+    while( size )
+    {
+        size_t n;
+
+        if( !job->fill )
+        {
+            int abort;
+            pthread_mutex_lock( &pipe->pool->lock );
+            while( job->count == KPIPE_DEPTH && !pipe->abort )
+                pthread_cond_wait( &pipe->consumed, &pipe->pool->lock );
+            abort = pipe->abort;
+            pthread_mutex_unlock( &pipe->pool->lock );
+            if( abort ) return 0;
+        }
+        n = KPIPE_CHUNK_SIZE - job->fill;
+        if( n > size ) n = size;
+        memcpy( SLOT( job, job->tail ) + job->fill, buf, n );
+        job->fill += n;
+        buf += n;
+        size -= n;
+        if( job->fill == KPIPE_CHUNK_SIZE ) pipePublish( pipe, job );
+    }
+    return 1;
+}
+
+/*
+ * Pool lock held.
+ */
+static void pipeUnqueue( KPipePool pool, KPipe pipe )
+{
+    KPipe prev = NULL;
+    KPipe cur;
+
+    if( !pipe->queued ) return;
+    for( cur = pool->first; cur != pipe; cur = cur->qnext )
+        prev = cur;
+    if( prev ) prev->qnext = pipe->qnext;
+    else pool->first = pipe->qnext;
+    if( pool->last == pipe ) pool->last = prev;
+    pipe->qnext = NULL;
+    pipe->queued = 0;
+}
+
+/*
+ * Pool lock held: next item of the first pipe whose window allows it. A
+ * pipe leaves the queue when its last item is taken.
+ */
+static PipeJob pipeNext( KPipePool pool, KPipe * owner )
+{
+    KPipe pipe;
+
+    for( pipe = pool->first; pipe; pipe = pipe->qnext )
+    {
+        if( pipe->next < pipe->drained + pipe->window )
+        {
+            PipeJob job = &pipe->jobs[pipe->next++];
+            pipe->busy++;
+            if( pipe->next == pipe->count ) pipeUnqueue( pool, pipe );
+            *owner = pipe;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static void * pipeWorker( void * arg )
+{
+    KPipePool pool = (KPipePool)arg;
+    PipeCtx ctx;
+
+    pthread_mutex_lock( &pool->lock );
+    for( ;; )
+    {
+        int rc;
+
+        ctx.job = pipeNext( pool, &ctx.pipe );
+        if( !ctx.job )
+        {
+            if( pool->stop ) break;
+            pthread_cond_wait( &pool->work, &pool->lock );
+            continue;
+        }
+        pthread_mutex_unlock( &pool->lock );
+
+        ctx.job->slots = Malloc( KPIPE_DEPTH * (KPIPE_CHUNK_SIZE + 1) );
+        if( !ctx.job->slots )
+        {
+            scpyc( ctx.job->error, "kpipe: out of memory" );
+            rc = 0;
+        }
+        else
+        {
+            rc = ctx.pipe->produce( ctx.job->item, pipeWriter, &ctx,
+                    ctx.job->error );
+            if( rc && ctx.job->fill ) rc = pipePublish( ctx.pipe, ctx.job );
+        }
+
+        pthread_mutex_lock( &pool->lock );
+        ctx.job->rc = rc;
+        ctx.job->done = 1;
+        ctx.pipe->busy--;
+        pthread_cond_broadcast( &ctx.pipe->produced );
+    }
+    pthread_mutex_unlock( &pool->lock );
+    return NULL;
+}
+
+KPipePool kpipe_PoolCreate( size_t workers )
+{
+    size_t i;
+    KPipePool pool = Calloc( sizeof(struct _KPipePool), 1 );
+    if( !pool ) return NULL;
+
+    pool->refs = 1;
+    pthread_mutex_init( &pool->lock, NULL );
+    pthread_cond_init( &pool->work, NULL );
+    if( workers > KPIPE_MAX_WORKERS ) workers = KPIPE_MAX_WORKERS;
+    if( !workers ) workers = 1;
+    for( i = 0; i < workers; i++ )
+    {
+        if( pthread_create( &pool->threads[i], NULL, pipeWorker, pool ) ) break;
+        pool->nthreads++;
+    }
+    if( pool->nthreads ) return pool;
+
+    kpipe_PoolUnref( pool );
+    return NULL;
+}
+
+KPipePool kpipe_PoolRef( KPipePool pool )
+{
+    __sync_add_and_fetch( &pool->refs, 1 );
+    return pool;
+}
+
+void kpipe_PoolUnref( KPipePool pool )
+{
+    size_t i;
+
+    if( !pool || __sync_sub_and_fetch( &pool->refs, 1 ) ) return;
+    pthread_mutex_lock( &pool->lock );
+    pool->stop = 1;
+    pthread_cond_broadcast( &pool->work );
+    pthread_mutex_unlock( &pool->lock );
+    for( i = 0; i < pool->nthreads; i++ )
+        pthread_join( pool->threads[i], NULL );
+    pthread_cond_destroy( &pool->work );
+    pthread_mutex_destroy( &pool->lock );
+    Free( pool );
+}
+
+/*
+ * Pool lock held.
+ */
+static void pipeAbort( KPipe pipe )
+{
+    pipe->abort = 1;
+    pipeUnqueue( pipe->pool, pipe );
+    pthread_cond_broadcast( &pipe->consumed );
+    pthread_cond_broadcast( &pipe->produced );
+}
+
+KPipe kpipe_Start( KPipePool pool, void ** items, size_t count,
+        PipeProducer produce )
+{
+    size_t i;
+    KPipe pipe = Calloc( sizeof(struct _KPipe), 1 );
+    if( !pipe ) return NULL;
+
+    pipe->jobs = Calloc( sizeof(struct _PipeJob), count ? count : 1 );
+    if( !pipe->jobs )
+    {
+        Free( pipe );
+        return NULL;
+    }
+    for( i = 0; i < count; i++ )
+    {
+        pipe->jobs[i].item = items[i];
+        pipe->jobs[i].error = snew();
+        if( !pipe->jobs[i].error ) break;
+    }
+    pipe->count = i;
+    pipe->produce = produce;
+    pipe->pool = kpipe_PoolRef( pool );
+    pthread_cond_init( &pipe->produced, NULL );
+    pthread_cond_init( &pipe->consumed, NULL );
+    if( i < count ) goto perr;
+
+    pipe->window = pool->nthreads < count ? pool->nthreads : count;
+    if( !count ) return pipe;
+    pthread_mutex_lock( &pool->lock );
+    if( pool->last ) pool->last->qnext = pipe;
+    else pool->first = pipe;
+    pool->last = pipe;
+    pipe->queued = 1;
+    pthread_cond_broadcast( &pool->work );
+    pthread_mutex_unlock( &pool->lock );
+    return pipe;
+
+    perr: kpipe_Stop( pipe );
+    return NULL;
+}
+
+int kpipe_Drain( KPipe pipe, size_t idx, PipeWriter writer, void * ctx,
+        string error )
+{
+    PipeJob job = &pipe->jobs[idx];
+    pthread_mutex_t * lock = &pipe->pool->lock;
+    int rc = 1;
+
+    pthread_mutex_lock( lock );
+    for( ;; )
+    {
+        const char * slot;
+        size_t size;
+
+        while( !job->count && !job->done && !pipe->abort )
+            pthread_cond_wait( &pipe->produced, lock );
+        if( pipe->abort || (job->done && !job->rc) || !job->count )
+        {
+            break;
+        }
+        slot = SLOT( job, job->head );
+        size = job->sizes[job->head];
+        pthread_mutex_unlock( lock );
+
+        rc = writer( ctx, slot, size );
+
+        pthread_mutex_lock( lock );
+        job->head = (job->head + 1) % KPIPE_DEPTH;
+        job->count--;
+        pthread_cond_broadcast( &pipe->consumed );
+        if( !rc )
+        {
+            pipeAbort( pipe );
+            pthread_mutex_unlock( lock );
+            return 0;
+        }
+    }
+
+    if( pipe->abort || !job->rc )
+    {
+        if( slen( job->error ) ) scpyc( error, sstr( job->error ) );
+        else scpyc( error, "kpipe: aborted" );
+        pipeAbort( pipe );
+        rc = 0;
+    }
+    else
+    {
+        pipe->drained = idx + 1;
+        Free( job->slots );
+        job->slots = NULL;
+        if( pipe->queued ) pthread_cond_broadcast( &pipe->pool->work );
+    }
+    pthread_mutex_unlock( lock );
+    return rc;
+}
+
+void kpipe_Stop( KPipe pipe )
+{
+    size_t i;
+    KPipePool pool;
+
+    if( !pipe ) return;
+    pool = pipe->pool;
+    pthread_mutex_lock( &pool->lock );
+    pipeAbort( pipe );
+    while( pipe->busy )
+        pthread_cond_wait( &pipe->produced, &pool->lock );
+    pthread_mutex_unlock( &pool->lock );
+
+    for( i = 0; i < pipe->count; i++ )
+    {
+        Free( pipe->jobs[i].slots );
+        sdel( pipe->jobs[i].error );
+    }
+    pthread_cond_destroy( &pipe->consumed );
+    pthread_cond_destroy( &pipe->produced );
+    Free( pipe->jobs );
+    Free( pipe );
+    kpipe_PoolUnref( pool );
+}
@@ -0,0 +1,110 @@
+/*
+ * kpipe.h, part of "ksmtp" project.
+ */
+
+#ifndef KPIPE_H_
+#define KPIPE_H_
+
+#include "../klib/config.h"
+#include "../stringlib/stringlib.h"
+#include <pthread.h>
+
+#define KPIPE_CHUNK_SIZE    (64 * 1024)
+#define KPIPE_DEPTH         4
+#define KPIPE_MAX_WORKERS   16
+
+/*
+ * Same signature as MsgWriter/MimeWriter, 'buf' is NUL-terminated.
+ */
+typedef int (*PipeWriter)( void * ctx, const char * buf, size_t size );
+
+/*
+ * Produces the whole output of one item through 'writer', called from a
+ * worker thread. Returns 0 on error and fills 'error'.
+ */
+typedef int (*PipeProducer)( void * item, PipeWriter writer, void * wctx,
+        string error );
+
+/*
+ * Every item has a bounded ring of KPIPE_DEPTH chunks. Workers take items
+ * in order, never more than 'window' items ahead of the consumer, so
+ * memory stays below window * KPIPE_DEPTH * KPIPE_CHUNK_SIZE per pipe.
+ */
+typedef struct _PipeJob
+{
+    void * item;
+    char * slots;
+    size_t sizes[KPIPE_DEPTH];
+    size_t head;
+    size_t tail;
+    size_t count;
+    size_t fill;
+    int done;
+    int rc;
+    string error;
+}*PipeJob;
+
+/*
+ * Persistent worker threads shared by any number of pipes, e.g. messages
+ * written by several sessions at once. Pipes are served in the order they
+ * were started. Can be shared by several KMsg/KMail objects.
+ */
+typedef struct _KPipePool
+{
+    struct _KPipe * first;
+    struct _KPipe * last;
+    int stop;
+    size_t nthreads;
+    pthread_t threads[KPIPE_MAX_WORKERS];
+    volatile size_t refs;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+}*KPipePool;
+
+/*
+ * One msg_Write(): its items, queued in the pool while some are not yet
+ * taken. 'busy' - items being produced right now. Guarded by the pool lock.
+ */
+typedef struct _KPipe
+{
+    KPipePool pool;
+    struct _KPipe * qnext;
+    int queued;
+    PipeProducer produce;
+    PipeJob jobs;
+    size_t count;
+    size_t next;
+    size_t drained;
+    size_t window;
+    size_t busy;
+    int abort;
+    pthread_cond_t produced;
+    pthread_cond_t consumed;
+}*KPipe;
+
+/*
+ * Starts 'workers' threads (at most KPIPE_MAX_WORKERS), they live until
+ * the last reference is dropped. NULL on error.
+ */
+KPipePool kpipe_PoolCreate( size_t workers );
+KPipePool kpipe_PoolRef( KPipePool pool );
+void kpipe_PoolUnref( KPipePool pool );
+
+/*
+ * Queues 'count' items to the pool's workers. NULL on error.
+ */
+KPipe kpipe_Start( KPipePool pool, void ** items, size_t count,
+        PipeProducer produce );
+/*
+ * Writes the output of item 'idx' to 'writer' as it is produced. Items
+ * must be drained in order.
+ */
+int kpipe_Drain( KPipe pipe, size_t idx, PipeWriter writer, void * ctx,
+        string error );
+/*
+ * Aborts unfinished items, waits for the workers to leave them and frees
+ * the pipe. The pool's threads keep running.
+ */
+void kpipe_Stop( KPipe pipe );
+
+#endif /* KPIPE_H_ */
@@ -0,0 +1,89 @@
+/*
+ * kqueue.c, part of "ksmtp" project.
+ */
+
+#include "kqueue.h"
+
+KQueue kqueue_Create( size_t size )
+{
+    size_t i;
+    size_t cells = 2;
+    KQueue queue = Calloc( sizeof(struct _KQueue), 1 );
+    if( !queue ) return NULL;
+
+    while( cells < size )
+        cells <<= 1;
+    queue->cells = Calloc( sizeof(QueueCell), cells );
+    if( !queue->cells )
+    {
+        Free( queue );
+        return NULL;
+    }
+    for( i = 0; i < cells; i++ )
+        queue->cells[i].seq = i;
+    queue->mask = cells - 1;
+    return queue;
+}
+
+void kqueue_Destroy( KQueue queue )
+{
+    if( !queue ) return;
+    Free( queue->cells );
+    Free( queue );
+}
+
+int kqueue_Push( KQueue queue, void * data )
+{
+    QueueCell * cell;
+    size_t pos = __atomic_load_n( &queue->head, __ATOMIC_RELAXED );
+
+    for( ;; )
+    {
+        long diff;
+        cell = &queue->cells[pos & queue->mask];
+        diff = (long)__atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE )
+                - (long)pos;
+        if( !diff )
+        {
+            if( __atomic_compare_exchange_n( &queue->head, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) break;
+        }
+        else if( diff < 0 ) return 0;
+        else pos = __atomic_load_n( &queue->head, __ATOMIC_RELAXED );
+    }
+    cell->data = data;
+    __atomic_store_n( &cell->seq, pos + 1, __ATOMIC_RELEASE );
+    return 1;
+}
+
+void * kqueue_Pop( KQueue queue )
+{
+    QueueCell * cell;
+    void * data;
+    size_t pos = __atomic_load_n( &queue->tail, __ATOMIC_RELAXED );
+
+    for( ;; )
+    {
+        long diff;
+        cell = &queue->cells[pos & queue->mask];
+        diff = (long)__atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE )
+                - (long)(pos + 1);
+        if( !diff )
+        {
+            if( __atomic_compare_exchange_n( &queue->tail, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) break;
+        }
+        else if( diff < 0 ) return NULL;
+        else pos = __atomic_load_n( &queue->tail, __ATOMIC_RELAXED );
+    }
+    data = cell->data;
+    __atomic_store_n( &cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE );
+    return data;
+}
+
+size_t kqueue_Size( KQueue queue )
+{
+    size_t head = __atomic_load_n( &queue->head, __ATOMIC_RELAXED );
+    size_t tail = __atomic_load_n( &queue->tail, __ATOMIC_RELAXED );
+    return head > tail ? head - tail : 0;
+}
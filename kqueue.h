@@ -0,0 +1,48 @@
+/*
+ * kqueue.h, part of "ksmtp" project.
+ */
+
+#ifndef KQUEUE_H_
+#define KQUEUE_H_
+
+#include "../klib/config.h"
+
+#define KQUEUE_LINE     64
+
+typedef struct _QueueCell
+{
+    size_t seq;
+    void * data;
+} QueueCell;
+
+/*
+ * Bounded lock-free MPMC ring (D. Vyukov): every cell carries a sequence
+ * number, producers and consumers claim positions with one CAS each.
+ */
+typedef struct _KQueue
+{
+    QueueCell * cells;
+    size_t mask;
+    char pad0[KQUEUE_LINE];
+    size_t head;
+    char pad1[KQUEUE_LINE];
+    size_t tail;
+    char pad2[KQUEUE_LINE];
+}*KQueue;
+
+/*
+ * 'size' is rounded up to a power of 2.
+ */
+KQueue kqueue_Create( size_t size );
+void kqueue_Destroy( KQueue queue );
+/*
+ * Never blocks: returns 0 if the queue is full.
+ */
+int kqueue_Push( KQueue queue, void * data );
+/*
+ * Never blocks: returns NULL if the queue is empty.
+ */
+void * kqueue_Pop( KQueue queue );
+size_t kqueue_Size( KQueue queue );
+
+#endif /* KQUEUE_H_ */
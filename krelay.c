@@ -0,0 +1,246 @@
+/*
+ * krelay.c, part of "ksmtp" project.
+ */
+
+#include "krelay.h"
+#include <stdlib.h>
+#include <errno.h>
+
+static double relayClock( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+KRelays relay_Create( void )
+{
+    KRelays relays = Calloc( sizeof(struct _KRelays), 1 );
+    if( !relays ) return NULL;
+    if( pthread_mutex_init( &relays->lock, NULL ) )
+    {
+        Free( relays );
+        return NULL;
+    }
+    if( pthread_cond_init( &relays->cond, NULL ) )
+    {
+        pthread_mutex_destroy( &relays->lock );
+        Free( relays );
+        return NULL;
+    }
+    relays->seed = (unsigned)time( NULL ) ^ (unsigned)(size_t)relays;
+    relays->refs = 1;
+    return relays;
+}
+
+KRelays relay_Ref( KRelays relays )
+{
+    __sync_add_and_fetch( &relays->refs, 1 );
+    return relays;
+}
+
+void relay_Unref( KRelays relays )
+{
+    size_t i;
+
+    if( !relays || __sync_sub_and_fetch( &relays->refs, 1 ) ) return;
+    for( i = 0; i < relays->count; i++ )
+        Free( relays->relays[i].host );
+    pthread_cond_destroy( &relays->cond );
+    pthread_mutex_destroy( &relays->lock );
+    Free( relays );
+}
+
+int relay_Add( KRelays relays, const char * host, int port,
+        unsigned weight )
+{
+    Relay relay;
+    int rc = 0;
+
+    pthread_mutex_lock( &relays->lock );
+    if( relays->count < KRELAY_MAX && port > 0 )
+    {
+        relay = &relays->relays[relays->count];
+        memset( relay, 0, sizeof(struct _Relay) );
+        relay->host = Strdup( host );
+        if( relay->host )
+        {
+            relay->port = port;
+            relay->weight = weight ? weight : 1;
+            relay->cwnd = KRELAY_INIT_SESSIONS;
+            relay->rate = KRELAY_INIT_RATE;
+            relay->tokens = 1;
+            relay->stamp = relayClock();
+            relay->idx = relays->count++;
+            rc = 1;
+        }
+    }
+    pthread_mutex_unlock( &relays->lock );
+    return rc;
+}
+
+/*
+ * Unknown latency is taken as 100 ms, so new relays get their share.
+ */
+static double relayScore( Relay relay )
+{
+    double latency = relay->latency > 0 ? relay->latency : 100.0;
+    return relay->weight / ((1.0 + latency / 100.0)
+            * (1.0 + 10.0 * relay->errors));
+}
+
+static int relayFull( Relay relay )
+{
+    return relay->active >= (size_t)relay->cwnd;
+}
+
+Relay relay_Pick( KRelays relays, const char * tried, long wait )
+{
+    size_t i;
+    double point;
+    Relay relay = NULL;
+    struct timespec deadline;
+    int timeout = 0;
+
+    if( wait < 0 || wait > KRELAY_WAIT * 1000L ) wait = KRELAY_WAIT * 1000L;
+    clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += wait / 1000;
+    deadline.tv_nsec += (wait % 1000) * 1000000L;
+    if( deadline.tv_nsec >= 1000000000L )
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock( &relays->lock );
+    for( ;; )
+    {
+        double total = 0;
+        size_t busy = 0;
+        time_t now = time( NULL );
+
+        for( i = 0; i < relays->count; i++ )
+        {
+            Relay r = &relays->relays[i];
+            if( tried[i] || r->ejected > now ) continue;
+            if( relayFull( r ) ) busy++;
+            else total += relayScore( r );
+        }
+
+        if( total > 0 )
+        {
+            point = total * rand_r( &relays->seed ) / ((double)RAND_MAX + 1);
+            for( i = 0; i < relays->count; i++ )
+            {
+                Relay r = &relays->relays[i];
+                if( tried[i] || r->ejected > now || relayFull( r ) ) continue;
+                relay = r;
+                point -= relayScore( r );
+                if( point < 0 ) break;
+            }
+            break;
+        }
+        if( !busy )
+        {
+            for( i = 0; i < relays->count; i++ )
+            {
+                Relay r = &relays->relays[i];
+                if( tried[i] ) continue;
+                if( !relay || r->ejected < relay->ejected ) relay = r;
+            }
+            break;
+        }
+        if( timeout ) break;
+        timeout = pthread_cond_timedwait( &relays->cond, &relays->lock,
+                &deadline ) == ETIMEDOUT;
+    }
+    if( relay )
+    {
+        relay->sessions++;
+        relay->active++;
+    }
+    pthread_mutex_unlock( &relays->lock );
+    return relay;
+}
+
+void relay_Release( KRelays relays, Relay relay )
+{
+    pthread_mutex_lock( &relays->lock );
+    if( relay->active ) relay->active--;
+    pthread_cond_broadcast( &relays->cond );
+    pthread_mutex_unlock( &relays->lock );
+}
+
+void relay_Report( KRelays relays, Relay relay, int ok, double ms )
+{
+    pthread_mutex_lock( &relays->lock );
+    if( ms >= 0 )
+    {
+        relay->latency = relay->latency > 0 ?
+                relay->latency + KRELAY_ALPHA * (ms - relay->latency) : ms;
+    }
+    relay->errors += KRELAY_ALPHA * ((ok ? 0.0 : 1.0) - relay->errors);
+    if( ok )
+    {
+        relay->fails = 0;
+        relay->ejected = 0;
+    }
+    else if( ++relay->fails >= KRELAY_MAX_FAILS )
+    {
+        relay->ejected = time( NULL ) + KRELAY_EJECT;
+    }
+    pthread_mutex_unlock( &relays->lock );
+}
+
+/*
+ * Token bucket with a burst of one second. Tokens go negative, so waiting
+ * senders queue up behind each other.
+ */
+double relay_Pace( KRelays relays, Relay relay )
+{
+    double now, burst, wait = 0;
+
+    pthread_mutex_lock( &relays->lock );
+    now = relayClock();
+    burst = relay->rate > 1.0 ? relay->rate : 1.0;
+    relay->tokens += (now - relay->stamp) * relay->rate / 1000.0;
+    if( relay->tokens > burst ) relay->tokens = burst;
+    relay->stamp = now;
+    relay->tokens -= 1.0;
+    if( relay->tokens < 0 ) wait = -relay->tokens * 1000.0 / relay->rate;
+    pthread_mutex_unlock( &relays->lock );
+    return wait;
+}
+
+void relay_Feedback( KRelays relays, Relay relay, int throttled )
+{
+    pthread_mutex_lock( &relays->lock );
+    if( !throttled )
+    {
+        relay->cwnd += 1.0 / relay->cwnd;
+        if( relay->cwnd > KRELAY_MAX_SESSIONS )
+        {
+            relay->cwnd = KRELAY_MAX_SESSIONS;
+        }
+        relay->rate += 1.0 / relay->rate;
+        if( relay->rate > KRELAY_MAX_RATE ) relay->rate = KRELAY_MAX_RATE;
+        if( (size_t)relay->cwnd > relay->active )
+        {
+            pthread_cond_broadcast( &relays->cond );
+        }
+    }
+    else
+    {
+        double now = relayClock();
+        relay->throttled++;
+        if( now - relay->cut >= KRELAY_CUT_GAP )
+        {
+            relay->cut = now;
+            relay->cwnd *= KRELAY_BACKOFF;
+            if( relay->cwnd < 1.0 ) relay->cwnd = 1.0;
+            relay->rate *= KRELAY_BACKOFF;
+            if( relay->rate < KRELAY_MIN_RATE ) relay->rate = KRELAY_MIN_RATE;
+            if( relay->tokens > 0 ) relay->tokens = 0;
+        }
+    }
+    pthread_mutex_unlock( &relays->lock );
+}
@@ -0,0 +1,106 @@
+/*
+ * krelay.h, part of "ksmtp" project.
+ */
+
+#ifndef KRELAY_H_
+#define KRELAY_H_
+
+#include "../klib/config.h"
+#include <pthread.h>
+#include <time.h>
+
+#define KRELAY_MAX          32
+/*
+ * Consecutive failures before a relay is ejected, and for how long. After
+ * that one more failure ejects it again.
+ */
+#define KRELAY_MAX_FAILS    3
+#define KRELAY_EJECT        30
+/*
+ * EWMA smoothing factor for latency and error rate.
+ */
+#define KRELAY_ALPHA        0.2
+/*
+ * AIMD limits per relay: concurrent sessions and messages per second grow
+ * by about one per window of successes and are cut by KRELAY_BACKOFF on a
+ * throttling reply, at most once per KRELAY_CUT_GAP ms (replies from the
+ * sessions already in flight do not cut again).
+ */
+#define KRELAY_INIT_SESSIONS 4.0
+#define KRELAY_MAX_SESSIONS  64.0
+#define KRELAY_INIT_RATE     10.0
+#define KRELAY_MIN_RATE      0.5
+#define KRELAY_MAX_RATE      1000.0
+#define KRELAY_BACKOFF       0.5
+#define KRELAY_CUT_GAP       1000
+/*
+ * Longest relay_Pick() wait for a free session slot, seconds.
+ */
+#define KRELAY_WAIT          30
+
+typedef struct _Relay
+{
+    char * host;
+    int port;
+    unsigned weight;
+    size_t idx;
+    double latency;
+    double errors;
+    size_t fails;
+    time_t ejected;
+    size_t sessions;
+    size_t active;
+    double cwnd;
+    double rate;
+    double tokens;
+    double stamp;
+    double cut;
+    size_t throttled;
+}*Relay;
+
+/*
+ * Relay list with health scores. Can be shared by several KMail objects,
+ * also from different threads.
+ */
+typedef struct _KRelays
+{
+    struct _Relay relays[KRELAY_MAX];
+    size_t count;
+    unsigned seed;
+    volatile size_t refs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+}*KRelays;
+
+KRelays relay_Create( void );
+KRelays relay_Ref( KRelays relays );
+void relay_Unref( KRelays relays );
+
+int relay_Add( KRelays relays, const char * host, int port,
+        unsigned weight );
+/*
+ * Weighted random choice by weight / (latency * error rate) among relays
+ * that are not ejected, not 'tried' (array of relays->count flags) and
+ * have a free session slot. Waits up to 'wait' ms for a slot (< 0 or more
+ * than KRELAY_WAIT seconds - KRELAY_WAIT), NULL if there is none. If all
+ * are ejected the one to come back first is returned. The slot is held
+ * until relay_Release().
+ */
+Relay relay_Pick( KRelays relays, const char * tried, long wait );
+void relay_Release( KRelays relays, Relay relay );
+/*
+ * 'ms' < 0 - latency is not known.
+ */
+void relay_Report( KRelays relays, Relay relay, int ok, double ms );
+/*
+ * Takes one message from the relay's rate and returns how many ms to wait
+ * before sending it.
+ */
+double relay_Pace( KRelays relays, Relay relay );
+/*
+ * AIMD step: an accepted message or a throttling reply (421, 450, 451,
+ * 4.7.x).
+ */
+void relay_Feedback( KRelays relays, Relay relay, int throttled );
+
+#endif /* KRELAY_H_ */
@@ -0,0 +1,483 @@
+/*
+ * kspool.c, part of "ksmtp" project.
+ */
+
+#include "kspool.h"
+#include "addr.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char * spoolStates[] =
+{ "pending", "sent", "rejected", "failed" };
+
+static char * spoolPath( const char * dir, const char * name,
+        const char * suffix )
+{
+    size_t size = strlen( dir ) + strlen( name ) + strlen( suffix ) + 2;
+    char * path = Malloc( size );
+    if( !path ) return NULL;
+    if( *name == '/' || !*dir ) snprintf( path, size, "%s%s", name, suffix );
+    else snprintf( path, size, "%s/%s%s", dir, name, suffix );
+    return path;
+}
+
+static char * spoolToken( char ** ptr )
+{
+    char * start = *ptr + strspn( *ptr, " \t\r\n" );
+    char * end;
+
+    if( !*start ) return NULL;
+    end = start + strcspn( start, " \t\r\n" );
+    if( *end ) *end++ = 0;
+    *ptr = end;
+    return start;
+}
+
+static int spoolParse( KSpool spool, const char * dir, char * line,
+        size_t * size, string error )
+{
+    char * ptr = line;
+    char * name = spoolToken( &ptr );
+    char * from;
+    char * rcpt;
+    SpoolEntry * e;
+
+    if( !name || *name == '#' ) return 1;
+    if( !(from = spoolToken( &ptr )) )
+    {
+        scpyc( error, "no sender" );
+        return 0;
+    }
+    if( spool->count == *size )
+    {
+        size_t n = *size ? *size * 2 : 1024;
+        e = Realloc( spool->entries, n * sizeof(SpoolEntry) );
+        if( !e ) goto pmerror;
+        spool->entries = e;
+        *size = n;
+    }
+
+    e = &spool->entries[spool->count++];
+    memset( e, 0, sizeof(SpoolEntry) );
+    e->name = Strdup( name );
+    e->file = spoolPath( dir, name, "" );
+    e->from = Strdup( strcmp( from, "<>" ) ? from : "" );
+    e->rcpts = lcreate( deleteAddr );
+    if( !e->name || !e->file || !e->from || !e->rcpts ) goto pmerror;
+    while( (rcpt = spoolToken( &ptr )) )
+    {
+        Pair addr = createAddr( rcpt );
+        if( !addr ) goto pmerror;
+        if( !ladd( e->rcpts, addr ) )
+        {
+            deleteAddr( addr );
+            goto pmerror;
+        }
+    }
+    if( !e->rcpts->size )
+    {
+        scpyc( error, "no recipients" );
+        return 0;
+    }
+    return 1;
+
+    pmerror: scpyc( error, "internal error" );
+    return 0;
+}
+
+/*
+ * Replaces the recipients with the addresses in 'list' (separated by
+ * spaces), what is left to retry of a partly delivered file.
+ */
+static int spoolSetRcpts( SpoolEntry * e, char * list )
+{
+    List rcpts = lcreate( deleteAddr );
+    char * rcpt;
+
+    if( !rcpts ) return 0;
+    while( (rcpt = spoolToken( &list )) )
+    {
+        Pair addr = createAddr( rcpt );
+        if( !addr || !ladd( rcpts, addr ) )
+        {
+            if( addr ) deleteAddr( addr );
+            ldestroy( rcpts );
+            return 0;
+        }
+    }
+    if( !rcpts->size )
+    {
+        ldestroy( rcpts );
+        return 1;
+    }
+    ldestroy( e->rcpts );
+    e->rcpts = rcpts;
+    return 1;
+}
+
+static int spoolCmp( const void * a, const void * b )
+{
+    return strcmp( (*(const SpoolEntry * const *)a)->name,
+            (*(const SpoolEntry * const *)b)->name );
+}
+
+/*
+ * The last record for a file wins, a failed one with a recipient list
+ * narrows the file to them. Entries are looked up through a sorted array
+ * of pointers: the journal can be as long as the index.
+ */
+static int spoolReadJournal( KSpool spool, const char * path, char * line )
+{
+    SpoolEntry ** sorted;
+    FILE * in = fopen( path, "r" );
+    size_t i;
+
+    if( !in ) return errno == ENOENT;
+    sorted = Malloc( (spool->count ? spool->count : 1) * sizeof(SpoolEntry *) );
+    if( !sorted )
+    {
+        fclose( in );
+        return 0;
+    }
+    for( i = 0; i < spool->count; i++ )
+        sorted[i] = &spool->entries[i];
+    qsort( sorted, spool->count, sizeof(SpoolEntry *), spoolCmp );
+
+    while( fgets( line, KSPOOL_MAX_LINE, in ) )
+    {
+        char * ptr = line;
+        char * state = spoolToken( &ptr );
+        char * list;
+        struct _SpoolEntry key;
+        SpoolEntry * pkey = &key;
+        SpoolEntry ** found;
+
+        if( !state || !(key.name = spoolToken( &ptr )) ) continue;
+        found = bsearch( &pkey, sorted, spool->count, sizeof(SpoolEntry *),
+                spoolCmp );
+        if( !found ) continue;
+        for( i = SPOOL_SENT; i <= SPOOL_FAILED; i++ )
+        {
+            if( !strcmp( state, spoolStates[i] ) )
+            {
+                (*found)->state = (SpoolState)i;
+                break;
+            }
+        }
+        /* "failed\tname\tcode\treason\trcpt rcpt..." */
+        if( (*found)->state != SPOOL_FAILED || !(list = strchr( ptr, '\t' ))
+                || !(list = strchr( list + 1, '\t' )) )
+        {
+            continue;
+        }
+        if( !spoolSetRcpts( *found, list + 1 ) )
+        {
+            Free( sorted );
+            fclose( in );
+            return 0;
+        }
+    }
+    Free( sorted );
+    fclose( in );
+    return 1;
+}
+
+/*
+ * Files left to send: pending and failed ones, in index order.
+ */
+static void spoolTodo( KSpool spool )
+{
+    size_t i;
+
+    spool->ntodo = 0;
+    for( i = 0; i < spool->count; i++ )
+    {
+        SpoolState state = spool->entries[i].state;
+        if( state == SPOOL_PENDING || state == SPOOL_FAILED )
+        {
+            spool->todo[spool->ntodo++] = i;
+        }
+    }
+    spool->skipped = spool->count - spool->ntodo;
+}
+
+KSpool spool_Open( const char * dir, const char * index, string error )
+{
+    FILE * in = NULL;
+    char * path = NULL;
+    char * jpath = NULL;
+    char * line = Malloc( KSPOOL_MAX_LINE );
+    size_t size = 0;
+    size_t lineno = 0;
+    KSpool spool = Calloc( sizeof(struct _KSpool), 1 );
+
+    if( !spool || pthread_mutex_init( &spool->lock, NULL ) )
+    {
+        Free( spool );
+        Free( line );
+        scpyc( error, "spool_Open(), internal error" );
+        return NULL;
+    }
+    path = spoolPath( dir, index ? index : KSPOOL_INDEX, "" );
+    jpath = spoolPath( dir, index ? index : KSPOOL_INDEX, KSPOOL_JOURNAL );
+    if( !line || !path || !jpath )
+    {
+        scpyc( error, "spool_Open(), internal error" );
+        goto pmerror;
+    }
+
+    if( !(in = fopen( path, "r" )) )
+    {
+        sprint( error, "spool_Open(\"%s\") - %s", path, strerror(errno) );
+        goto pmerror;
+    }
+    while( fgets( line, KSPOOL_MAX_LINE, in ) )
+    {
+        lineno++;
+        if( !strchr( line, '\n' ) && !feof( in ) )
+        {
+            sprint( error, "spool_Open(\"%s\"), line %zu - too long", path,
+                    lineno );
+            goto pmerror;
+        }
+        if( !spoolParse( spool, dir, line, &size, error ) )
+        {
+            string reason = sfromchar( sstr( error ) );
+            sprint( error, "spool_Open(\"%s\"), line %zu - %s", path, lineno,
+                    reason ? sstr( reason ) : "internal error" );
+            sdel( reason );
+            goto pmerror;
+        }
+    }
+    fclose( in );
+    in = NULL;
+
+    if( !spoolReadJournal( spool, jpath, line )
+            || !(spool->journal = fopen( jpath, "a" )) )
+    {
+        sprint( error, "spool_Open(\"%s\") - %s", jpath, strerror(errno) );
+        goto pmerror;
+    }
+    spool->todo = Malloc( (spool->count ? spool->count : 1) * sizeof(size_t) );
+    if( !spool->todo )
+    {
+        scpyc( error, "spool_Open(), internal error" );
+        goto pmerror;
+    }
+    spoolTodo( spool );
+
+    Free( line );
+    Free( path );
+    Free( jpath );
+    return spool;
+
+    pmerror: if( in ) fclose( in );
+    Free( line );
+    Free( path );
+    Free( jpath );
+    spool_Close( spool );
+    return NULL;
+}
+
+void spool_Close( KSpool spool )
+{
+    size_t i;
+
+    if( !spool ) return;
+    for( i = 0; i < spool->count; i++ )
+    {
+        SpoolEntry * e = &spool->entries[i];
+        Free( e->name );
+        Free( e->file );
+        Free( e->from );
+        if( e->rcpts ) ldestroy( e->rcpts );
+    }
+    if( spool->journal ) fclose( spool->journal );
+    Free( spool->entries );
+    Free( spool->todo );
+    pthread_mutex_destroy( &spool->lock );
+    Free( spool );
+}
+
+/*
+ * Starts reading the file into the page cache in the background, so the
+ * sender does not wait for the disk.
+ */
+static void spoolPrefetch( KSpool spool, size_t idx )
+{
+    int fd = open( spool->entries[spool->todo[idx]].file, O_RDONLY );
+    if( fd < 0 ) return;
+    posix_fadvise( fd, 0, 0, POSIX_FADV_WILLNEED );
+    close( fd );
+}
+
+/*
+ * Recipients of the last send worth a retry (RS_DEFERRED, RS_SKIPPED) into
+ * 'list', separated by spaces. Returns their number, '*deferred' is set if
+ * the server deferred one of them.
+ */
+static size_t spoolRetry( KMail mail, string list, int * deferred )
+{
+    size_t count;
+    size_t i;
+    size_t n = 0;
+    const RcptStatus * st = mail_GetRcptStatus( mail, &count );
+
+    sclear( list );
+    *deferred = 0;
+    for( i = 0; i < count; i++ )
+    {
+        if( st[i].state != RS_DEFERRED && st[i].state != RS_SKIPPED ) continue;
+        if( st[i].state == RS_DEFERRED ) *deferred = 1;
+        if( n++ ) scatc( list, " " );
+        scatc( list, st[i].email );
+    }
+    return n;
+}
+
+/*
+ * 'rcpts' - what is left to retry of a partly delivered file (NULL - all
+ * of it), journaled with a failed file and kept for the next run.
+ */
+static void spoolDone( KSpool spool, SpoolEntry * e, SpoolState state,
+        KMail mail, string rcpts )
+{
+    char reason[256];
+    char * ptr;
+
+    e->state = state;
+    __sync_add_and_fetch( state == SPOOL_SENT ? &spool->sent :
+            state == SPOOL_REJECTED ? &spool->rejected : &spool->failed, 1 );
+
+    snprintf( reason, sizeof(reason), "%s",
+            state == SPOOL_SENT ? "" : mail_GetError( mail ) );
+    for( ptr = reason; *ptr; ptr++ )
+        if( *ptr == '\r' || *ptr == '\n' || *ptr == '\t' ) *ptr = ' ';
+
+    pthread_mutex_lock( &spool->lock );
+    fprintf( spool->journal, "%s\t%s\t%d\t%s", spoolStates[state], e->name,
+            state == SPOOL_SENT ? 250 : mail_GetReplyCode( mail ), reason );
+    if( rcpts ) fprintf( spool->journal, "\t%s", sstr( rcpts ) );
+    fputc( '\n', spool->journal );
+    fflush( spool->journal );
+    pthread_mutex_unlock( &spool->lock );
+    if( rcpts ) spoolSetRcpts( e, sstr( rcpts ) );
+}
+
+/*
+ * Workers take files in index order through one atomic counter and keep
+ * the file KSPOOL_READAHEAD positions ahead in flight.
+ */
+static void * spoolWorker( void * arg )
+{
+    SpoolWorker * w = (SpoolWorker *)arg;
+    KSpool spool = w->spool;
+    string retry = snew();
+
+    if( !retry ) return NULL;
+    for( ;; )
+    {
+        SmtpReply reply;
+        SpoolEntry * e;
+        SpoolState state;
+        size_t left;
+        int sent;
+        int deferred;
+        size_t idx = __sync_fetch_and_add( &spool->next, 1 );
+
+        if( idx >= spool->ntodo ) break;
+        if( idx + KSPOOL_READAHEAD < spool->ntodo )
+        {
+            spoolPrefetch( spool, idx + KSPOOL_READAHEAD );
+        }
+        e = &spool->entries[spool->todo[idx]];
+
+        if( !w->open )
+        {
+            w->open = mail_OpenSession( w->mail, spool->tls, spool->auth );
+            if( !w->open )
+            {
+                mail_CloseSession( w->mail );
+                spoolDone( spool, e, SPOOL_FAILED, w->mail, NULL );
+                break;
+            }
+        }
+        sent = mail_SendFromFile( w->mail, e->file, e->from, e->rcpts, NULL,
+                NULL );
+        left = spoolRetry( w->mail, retry, &deferred );
+        mail_GetReply( w->mail, &reply );
+        if( sent && !left ) state = SPOOL_SENT;
+        else if( !sent && !deferred && reply.kind == SMTP_PERMANENT )
+        {
+            state = SPOOL_REJECTED;
+        }
+        else state = SPOOL_FAILED;
+        /*
+         * With KMAIL_PARTIAL a file can reach some recipients only: the
+         * others are journaled, so no one gets it twice.
+         */
+        spoolDone( spool, e, state, w->mail, state == SPOOL_FAILED && left
+                && left < e->rcpts->size ? retry : NULL );
+        if( mail_Broken( w->mail ) )
+        {
+            mail_CloseSession( w->mail );
+            w->open = 0;
+        }
+    }
+
+    if( w->open ) mail_CloseSession( w->mail );
+    w->open = 0;
+    sdel( retry );
+    return NULL;
+}
+
+int spool_Run( KSpool spool, size_t workers, MailFactory factory,
+        void * ctx, int tls, AuthType auth )
+{
+    size_t i;
+
+    spool->tls_cache = tlscache_Create();
+    if( !spool->tls_cache ) return 0;
+    spool->tls = tls;
+    spool->auth = auth;
+    spool->next = 0;
+    spool->sent = spool->rejected = spool->failed = 0;
+    spoolTodo( spool );
+    for( i = 0; i < KSPOOL_READAHEAD && i < spool->ntodo; i++ )
+        spoolPrefetch( spool, i );
+
+    if( workers > KDELIVER_MAX_WORKERS ) workers = KDELIVER_MAX_WORKERS;
+    if( workers > spool->ntodo ) workers = spool->ntodo;
+    if( !workers ) workers = 1;
+    for( i = 0; i < workers; i++ )
+    {
+        SpoolWorker * w = &spool->workers[i];
+        w->spool = spool;
+        w->open = 0;
+        w->mail = factory( ctx );
+        if( !w->mail ) break;
+        mail_SetTlsCache( w->mail, spool->tls_cache );
+        if( pthread_create( &w->thread, NULL, spoolWorker, w ) )
+        {
+            mail_Destroy( w->mail );
+            break;
+        }
+        spool->nworkers++;
+    }
+
+    for( i = 0; i < spool->nworkers; i++ )
+    {
+        pthread_join( spool->workers[i].thread, NULL );
+        mail_Destroy( spool->workers[i].mail );
+    }
+    spool->nworkers = 0;
+    tlscache_Unref( spool->tls_cache );
+    spool->tls_cache = NULL;
+
+    for( i = 0; i < spool->ntodo; i++ )
+    {
+        SpoolState state = spool->entries[spool->todo[i]].state;
+        if( state == SPOOL_PENDING || state == SPOOL_FAILED ) return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,94 @@
+/*
+ * kspool.h, part of "ksmtp" project.
+ */
+
+#ifndef KSPOOL_H_
+#define KSPOOL_H_
+
+#include "kdeliver.h"
+
+/*
+ * Default index in the spool directory, the journal is the index name with
+ * KSPOOL_JOURNAL appended.
+ */
+#define KSPOOL_INDEX        "index"
+#define KSPOOL_JOURNAL      ".journal"
+#define KSPOOL_MAX_LINE     (64 * 1024)
+/*
+ * Files prefetched into the page cache ahead of the senders.
+ */
+#define KSPOOL_READAHEAD    32
+
+/*
+ * Final states are kept over runs; SPOOL_FAILED (temporary errors) and
+ * SPOOL_PENDING are sent again.
+ */
+typedef enum _SpoolState
+{
+    SPOOL_PENDING = 0, SPOOL_SENT, SPOOL_REJECTED, SPOOL_FAILED
+} SpoolState;
+
+typedef struct _SpoolEntry
+{
+    char * name;
+    char * file;
+    char * from;
+    List rcpts;
+    SpoolState state;
+} SpoolEntry;
+
+typedef struct _SpoolWorker
+{
+    struct _KSpool * spool;
+    KMail mail;
+    int open;
+    pthread_t thread;
+} SpoolWorker;
+
+/*
+ * Index lines: "file from rcpt [rcpt...]", '#' starts a comment, file
+ * names are relative to the spool directory. Every outcome is appended to
+ * the journal, so an interrupted run goes on where it stopped. A file
+ * delivered to some recipients only (KMAIL_PARTIAL) is journaled as failed
+ * with the others, and is retried for them alone. A crash can lose the
+ * last records (no fsync per file): those files are sent twice rather than
+ * never. The counters are those of the last spool_Run().
+ */
+typedef struct _KSpool
+{
+    SpoolEntry * entries;
+    size_t count;
+    size_t * todo;
+    size_t ntodo;
+    size_t next;
+    FILE * journal;
+    pthread_mutex_t lock;
+    KTlsCache tls_cache;
+    int tls;
+    AuthType auth;
+    size_t nworkers;
+    SpoolWorker workers[KDELIVER_MAX_WORKERS];
+
+    size_t sent;
+    size_t rejected;
+    size_t failed;
+    size_t skipped;
+}*KSpool;
+
+/*
+ * 'index' NULL - KSPOOL_INDEX in 'dir'. Entries already in the journal as
+ * sent or rejected are skipped.
+ */
+KSpool spool_Open( const char * dir, const char * index, string error );
+/*
+ * Sends pending files over 'workers' sessions (KMail objects from
+ * 'factory'), returns when all are done. A worker that cannot open a
+ * session stops, its files stay for the next run; calling it again retries
+ * the pending and failed files only. Returns 1 if nothing is left to
+ * retry.
+ */
+int spool_Run( KSpool spool, size_t workers, MailFactory factory,
+        void * ctx, int tls, AuthType auth );
+void spool_Close( KSpool spool );
+
+#endif /* KSPOOL_H_ */
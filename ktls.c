@@ -0,0 +1,147 @@
+/*
+ * ktls.c, part of "ksmtp" project.
+ */
+
+#include "ktls.h"
+#include <time.h>
+
+KTlsCache tlscache_Create( void )
+{
+    KTlsCache cache = Calloc( sizeof(struct _KTlsCache), 1 );
+    if( !cache ) return NULL;
+    if( pthread_mutex_init( &cache->lock, NULL ) )
+    {
+        Free( cache );
+        return NULL;
+    }
+    cache->refs = 1;
+    return cache;
+}
+
+KTlsCache tlscache_Ref( KTlsCache cache )
+{
+    __sync_add_and_fetch( &cache->refs, 1 );
+    return cache;
+}
+
+static void delEntry( TlsEntry entry )
+{
+    SSL_SESSION_free( entry->session );
+    Free( entry->key );
+    Free( entry );
+}
+
+void tlscache_Clear( KTlsCache cache )
+{
+    pthread_mutex_lock( &cache->lock );
+    while( cache->first )
+    {
+        TlsEntry next = cache->first->next;
+        delEntry( cache->first );
+        cache->first = next;
+    }
+    cache->count = 0;
+    pthread_mutex_unlock( &cache->lock );
+}
+
+void tlscache_Unref( KTlsCache cache )
+{
+    if( cache && !__sync_sub_and_fetch( &cache->refs, 1 ) )
+    {
+        tlscache_Clear( cache );
+        pthread_mutex_destroy( &cache->lock );
+        Free( cache );
+    }
+}
+
+static int sessionValid( SSL_SESSION * session )
+{
+    long now = (long)time( NULL );
+    return SSL_SESSION_is_resumable( session )
+            && SSL_SESSION_get_time( session )
+                    + SSL_SESSION_get_timeout( session ) > now;
+}
+
+/*
+ * Unlinks the entry for 'key', called with the lock held.
+ */
+static TlsEntry takeEntry( KTlsCache cache, const char * key )
+{
+    TlsEntry * ptr = &cache->first;
+    while( *ptr )
+    {
+        TlsEntry entry = *ptr;
+        if( !strcmp( entry->key, key ) )
+        {
+            *ptr = entry->next;
+            cache->count--;
+            return entry;
+        }
+        ptr = &entry->next;
+    }
+    return NULL;
+}
+
+SSL_SESSION * tlscache_Get( KTlsCache cache, const char * host, int port )
+{
+    char key[512];
+    TlsEntry entry;
+    SSL_SESSION * session = NULL;
+
+    snprintf( key, sizeof(key), "%s:%d", host, port );
+    pthread_mutex_lock( &cache->lock );
+    entry = takeEntry( cache, key );
+    if( entry && !sessionValid( entry->session ) )
+    {
+        delEntry( entry );
+        entry = NULL;
+    }
+    if( entry )
+    {
+        SSL_SESSION_up_ref( entry->session );
+        session = entry->session;
+        entry->next = cache->first;
+        cache->first = entry;
+        cache->count++;
+        cache->hits++;
+    }
+    else cache->misses++;
+    pthread_mutex_unlock( &cache->lock );
+    return session;
+}
+
+void tlscache_Put( KTlsCache cache, const char * host, int port,
+        SSL_SESSION * session )
+{
+    char key[512];
+    TlsEntry entry;
+
+    snprintf( key, sizeof(key), "%s:%d", host, port );
+    pthread_mutex_lock( &cache->lock );
+    entry = takeEntry( cache, key );
+    if( entry ) delEntry( entry );
+    if( !session || !SSL_SESSION_is_resumable( session ) ) goto pend;
+
+    entry = Calloc( sizeof(struct _TlsEntry), 1 );
+    if( !entry || !(entry->key = Strdup( key )) )
+    {
+        Free( entry );
+        goto pend;
+    }
+    entry->session = session;
+    session = NULL;
+    entry->next = cache->first;
+    cache->first = entry;
+    if( ++cache->count > KTLS_CACHE_SIZE )
+    {
+        TlsEntry * ptr = &cache->first;
+        while( (*ptr)->next )
+            ptr = &(*ptr)->next;
+        delEntry( *ptr );
+        *ptr = NULL;
+        cache->count--;
+    }
+
+    pend: pthread_mutex_unlock( &cache->lock );
+    if( session ) SSL_SESSION_free( session );
+}
@@ -0,0 +1,53 @@
+/*
+ * ktls.h, part of "ksmtp" project.
+ */
+
+#ifndef KTLS_H_
+#define KTLS_H_
+
+#include "../klib/config.h"
+#include <openssl/ssl.h>
+#include <pthread.h>
+
+#define KTLS_CACHE_SIZE     64
+
+typedef struct _TlsEntry
+{
+    char * key;
+    SSL_SESSION * session;
+    struct _TlsEntry * next;
+}*TlsEntry;
+
+/*
+ * TLS sessions (tickets or IDs) per "host:port", most recent first. Can be
+ * shared by several KMail objects, also from different threads.
+ */
+typedef struct _KTlsCache
+{
+    TlsEntry first;
+    size_t count;
+    size_t hits;
+    size_t misses;
+    size_t resumed;
+    volatile size_t refs;
+    pthread_mutex_t lock;
+}*KTlsCache;
+
+KTlsCache tlscache_Create( void );
+KTlsCache tlscache_Ref( KTlsCache cache );
+void tlscache_Unref( KTlsCache cache );
+
+/*
+ * Returns a new reference to a still valid session or NULL, counts hits
+ * and misses.
+ */
+SSL_SESSION * tlscache_Get( KTlsCache cache, const char * host, int port );
+/*
+ * Takes over the 'session' reference; NULL or not resumable session drops
+ * the entry.
+ */
+void tlscache_Put( KTlsCache cache, const char * host, int port,
+        SSL_SESSION * session );
+void tlscache_Clear( KTlsCache cache );
+
+#endif /* KTLS_H_ */
@@ -0,0 +1,193 @@
+/*
+ * kzip.c, part of "ksmtp" project.
+ */
+
+#include "kzip.h"
+#include <time.h>
+
+#define ZIP_LOCAL_SIG       0x04034b50UL
+#define ZIP_DESC_SIG        0x08074b50UL
+#define ZIP_CENTRAL_SIG     0x02014b50UL
+#define ZIP_END_SIG         0x06054b50UL
+/*
+ * Bit 3: sizes and CRC in the data descriptor, bit 11: UTF-8 name.
+ */
+#define ZIP_FLAGS           0x0808
+#define ZIP_VERSION         20
+#define ZIP_DEFLATE         8
+#define ZIP_MAX             0xffffffffULL
+
+static char * put16( char * p, unsigned v )
+{
+    *p++ = (char)(v & 0xff);
+    *p++ = (char)((v >> 8) & 0xff);
+    return p;
+}
+
+static char * put32( char * p, unsigned long v )
+{
+    p = put16( p, (unsigned)(v & 0xffff) );
+    return put16( p, (unsigned)((v >> 16) & 0xffff) );
+}
+
+static int zipEmit( ZipStream * zs, const char * buf, size_t size )
+{
+    if( !size ) return 1;
+    if( !zs->writer( zs->ctx, buf, size ) )
+    {
+        zs->error = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Local header and the central directory entry share everything from
+ * "version needed" to the name length.
+ */
+static char * zipCommon( ZipStream * zs, char * p, int sizes )
+{
+    p = put16( p, ZIP_VERSION );
+    p = put16( p, ZIP_FLAGS );
+    p = put16( p, ZIP_DEFLATE );
+    p = put16( p, zs->dtime );
+    p = put16( p, zs->ddate );
+    p = put32( p, sizes ? zs->crc : 0 );
+    p = put32( p, sizes ? (unsigned long)zs->csize : 0 );
+    p = put32( p, sizes ? (unsigned long)zs->size : 0 );
+    p = put16( p, (unsigned)strlen( zs->name ) );
+    return put16( p, 0 );
+}
+
+static int zipLocal( ZipStream * zs )
+{
+    char head[30];
+    char * p = put32( head, ZIP_LOCAL_SIG );
+    zipCommon( zs, p, 0 );
+    return zipEmit( zs, head, sizeof(head) )
+            && zipEmit( zs, zs->name, strlen( zs->name ) );
+}
+
+static int zipTrailer( ZipStream * zs )
+{
+    char buf[46];
+    char * p;
+    size_t nlen = strlen( zs->name );
+    unsigned long long cd = 30 + nlen + zs->csize + 16;
+
+    if( zs->size > ZIP_MAX || cd > ZIP_MAX ) return 0;
+
+    p = put32( buf, ZIP_DESC_SIG );
+    p = put32( p, zs->crc );
+    p = put32( p, (unsigned long)zs->csize );
+    p = put32( p, (unsigned long)zs->size );
+    if( !zipEmit( zs, buf, (size_t)(p - buf) ) ) return 0;
+
+    p = put32( buf, ZIP_CENTRAL_SIG );
+    p = put16( p, ZIP_VERSION );
+    p = zipCommon( zs, p, 1 );
+    p = put16( p, 0 );
+    p = put16( p, 0 );
+    p = put16( p, 0 );
+    p = put32( p, 0 );
+    p = put32( p, 0 );
+    if( !zipEmit( zs, buf, (size_t)(p - buf) )
+            || !zipEmit( zs, zs->name, nlen ) ) return 0;
+
+    p = put32( buf, ZIP_END_SIG );
+    p = put16( p, 0 );
+    p = put16( p, 0 );
+    p = put16( p, 1 );
+    p = put16( p, 1 );
+    p = put32( p, (unsigned long)(46 + nlen) );
+    p = put32( p, (unsigned long)cd );
+    p = put16( p, 0 );
+    return zipEmit( zs, buf, (size_t)(p - buf) );
+}
+
+int zip_Init( ZipStream * zs, ZipMethod method, const char * name,
+        ZipWriter writer, void * ctx )
+{
+    time_t now = time( NULL );
+    struct tm tm;
+
+    memset( zs, 0, sizeof(ZipStream) - sizeof(zs->out) );
+    zs->method = method;
+    zs->writer = writer;
+    zs->ctx = ctx;
+    zs->name = name;
+    zs->crc = crc32( 0L, Z_NULL, 0 );
+
+    localtime_r( &now, &tm );
+    zs->dtime = (unsigned)((tm.tm_hour << 11) | (tm.tm_min << 5)
+            | (tm.tm_sec / 2));
+    zs->ddate = (unsigned)(((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5)
+            | tm.tm_mday);
+
+    /*
+     * windowBits 15 + 16: gzip wrapper, -15: raw deflate for ZIP.
+     */
+    if( deflateInit2( &zs->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+            method == ZIP_GZIP ? 15 + 16 : -15, 8,
+            Z_DEFAULT_STRATEGY ) != Z_OK ) return 0;
+    if( method == ZIP_GZIP )
+    {
+        zs->gz.name = (Bytef *)name;
+        zs->gz.time = (uLong)now;
+        zs->gz.os = 3;
+        deflateSetHeader( &zs->z, &zs->gz );
+        return 1;
+    }
+    if( !zipLocal( zs ) )
+    {
+        deflateEnd( &zs->z );
+        return 0;
+    }
+    return 1;
+}
+
+static int zipDeflate( ZipStream * zs, int flush )
+{
+    int rc;
+
+    do
+    {
+        size_t n;
+        zs->z.next_out = (Bytef *)zs->out;
+        zs->z.avail_out = sizeof(zs->out);
+        rc = deflate( &zs->z, flush );
+        if( rc == Z_STREAM_ERROR ) return 0;
+        n = sizeof(zs->out) - zs->z.avail_out;
+        zs->csize += n;
+        if( !zipEmit( zs, zs->out, n ) ) return 0;
+    } while( !zs->z.avail_out || (flush == Z_FINISH && rc != Z_STREAM_END) );
+    return 1;
+}
+
+int zip_Write( void * ctx, const char * buf, size_t size )
+{
+    ZipStream * zs = (ZipStream *)ctx;
+
+    if( zs->error ) return 0;
+    while( size )
+    {
+        uInt n = size > (1U << 30) ? (1U << 30) : (uInt)size;
+        if( zs->method == ZIP_ZIP ) zs->crc = crc32( zs->crc,
+                (const Bytef *)buf, n );
+        zs->size += n;
+        zs->z.next_in = (Bytef *)buf;
+        zs->z.avail_in = n;
+        if( !zipDeflate( zs, Z_NO_FLUSH ) ) return 0;
+        buf += n;
+        size -= n;
+    }
+    return 1;
+}
+
+int zip_End( ZipStream * zs, int ok )
+{
+    ok = ok && !zs->error && zipDeflate( zs, Z_FINISH );
+    if( ok && zs->method == ZIP_ZIP ) ok = zipTrailer( zs );
+    deflateEnd( &zs->z );
+    return ok;
+}
@@ -0,0 +1,56 @@
+/*
+ * kzip.h, part of "ksmtp" project.
+ */
+
+#ifndef KZIP_H_
+#define KZIP_H_
+
+#include "../klib/config.h"
+#include <zlib.h>
+
+#define ZIP_OUT_SIZE        (16 * 1024)
+
+typedef enum _ZipMethod
+{
+    ZIP_NONE = 0, ZIP_GZIP, ZIP_ZIP
+} ZipMethod;
+
+/*
+ * Same signature as MimeWriter.
+ */
+typedef int (*ZipWriter)( void * ctx, const char * buf, size_t size );
+
+/*
+ * Streaming deflate into .gz or a single-entry .zip. The ZIP entry has a
+ * data descriptor after the data, so nothing is seeked back or buffered;
+ * there is no ZIP64, entries stop at 4 GB.
+ */
+typedef struct _ZipStream
+{
+    z_stream z;
+    ZipMethod method;
+    ZipWriter writer;
+    void * ctx;
+    const char * name;
+    gz_header gz;
+    unsigned long crc;
+    unsigned long long size;
+    unsigned long long csize;
+    unsigned dtime;
+    unsigned ddate;
+    int error;
+    char out[ZIP_OUT_SIZE];
+} ZipStream;
+
+/*
+ * 'name' - file name stored in the archive, must live until zip_End().
+ */
+int zip_Init( ZipStream * zs, ZipMethod method, const char * name,
+        ZipWriter writer, void * ctx );
+int zip_Write( void * ctx, const char * buf, size_t size );
+/*
+ * Completes the archive if 'ok', frees the stream in any case.
+ */
+int zip_End( ZipStream * zs, int ok );
+
+#endif /* KZIP_H_ */
@@ -6,6 +6,96 @@
  */
 
 #include "mime.h"
+#include <time.h>
+#include <unistd.h>
+
+static const char b64_alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void b64_StreamInit( B64Stream * s, MimeWriter writer, void * ctx )
+{
+    s->writer = writer;
+    s->ctx = ctx;
+    s->ncarry = 0;
+    s->col = 0;
+    s->nout = 0;
+}
+
+static int b64_flush( B64Stream * s )
+{
+    int rc = 1;
+    if( s->nout )
+    {
+        s->out[s->nout] = 0;
+        rc = s->writer( s->ctx, s->out, s->nout );
+        s->nout = 0;
+    }
+    return rc;
+}
+
+static int b64_quad( B64Stream * s, const unsigned char * in, size_t n )
+{
+    char * out;
+
+    if( s->nout + 6 >= sizeof(s->out) && !b64_flush( s ) ) return 0;
+    if( s->col == B64_LINE_SIZE )
+    {
+        s->out[s->nout++] = '\r';
+        s->out[s->nout++] = '\n';
+        s->col = 0;
+    }
+    out = s->out + s->nout;
+    out[0] = b64_alphabet[in[0] >> 2];
+    out[1] = b64_alphabet[((in[0] & 0x03) << 4) | (n > 1 ? in[1] >> 4 : 0)];
+    out[2] = n > 1 ? b64_alphabet[((in[1] & 0x0f) << 2)
+            | (n > 2 ? in[2] >> 6 : 0)] : '=';
+    out[3] = n > 2 ? b64_alphabet[in[2] & 0x3f] : '=';
+    s->nout += 4;
+    s->col += 4;
+    return 1;
+}
+
+int b64_StreamWrite( B64Stream * s, const void * buf, size_t size )
+{
+    const unsigned char * in = (const unsigned char *)buf;
+
+    while( s->ncarry && s->ncarry < 3 && size )
+    {
+        s->carry[s->ncarry++] = *in++;
+        size--;
+    }
+    if( s->ncarry == 3 )
+    {
+        if( !b64_quad( s, s->carry, 3 ) ) return 0;
+        s->ncarry = 0;
+    }
+    while( size >= 3 )
+    {
+        if( !b64_quad( s, in, 3 ) ) return 0;
+        in += 3;
+        size -= 3;
+    }
+    while( size-- )
+        s->carry[s->ncarry++] = *in++;
+    return 1;
+}
+
+int b64_StreamEnd( B64Stream * s )
+{
+    if( s->ncarry && !b64_quad( s, s->carry, s->ncarry ) ) return 0;
+    s->ncarry = 0;
+    return b64_flush( s );
+}
+
+/*
+ * Exact b64_Stream*() output size for 'size' input bytes.
+ */
+size_t b64_EncodedSize( size_t size )
+{
+    size_t chars = (size + 2) / 3 * 4;
+    size_t lines = (chars + B64_LINE_SIZE - 1) / B64_LINE_SIZE;
+    return chars + (lines ? (lines - 1) * 2 : 0);
+}
 
 int isUsAscii( const char * s )
 {
@@ -57,8 +147,50 @@ string mimeFileName( const char * name, const char * charset )
     return filename;
 }
 
+static __thread unsigned long long rnd_state;
+
+static unsigned long long splitmix64( unsigned long long x )
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+unsigned long long mime_Random( void )
+{
+    unsigned long long x = rnd_state;
+
+    if( !x )
+    {
+        static unsigned long long threads;
+        struct timespec ts;
+        clock_gettime( CLOCK_REALTIME, &ts );
+        x = splitmix64( ((unsigned long long)ts.tv_sec << 30)
+                ^ (unsigned long long)ts.tv_nsec
+                ^ ((unsigned long long)getpid() << 40)
+                ^ (unsigned long long)(size_t)&rnd_state
+                ^ (__sync_add_and_fetch( &threads, 1 ) << 20) );
+        if( !x ) x = 0x9e3779b97f4a7c15ULL;
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rnd_state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * RFC 2046 bchars, 6 bits per character.
+ */
+static const char bnd_alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_.";
+
 char * mimeMakeBoundary( char * boundary )
 {
+    size_t i;
+    unsigned long long r = 0;
+
     if( !boundary )
     {
         boundary = Malloc( 33 );
@@ -66,7 +198,13 @@ char * mimeMakeBoundary( char * boundary )
     }
 
     strcpy( boundary, "=-" );
-    rnd_string( boundary + 2, 30 );
+    for( i = 0; i < 30; i++ )
+    {
+        if( !(i % 10) ) r = mime_Random();
+        boundary[i + 2] = bnd_alphabet[r & 0x3f];
+        r >>= 6;
+    }
+    boundary[32] = 0;
 
     return boundary;
 }
@@ -89,6 +227,11 @@ int isUsAsciiCs( const char * charset )
     return 0;
 }
 
+int isUtf8Cs( const char * charset )
+{
+    return !strcasecmp( charset, "UTF-8" ) || !strcasecmp( charset, "UTF8" );
+}
+
 const char *
 getMimeType( const char * filename, const char * ctype )
 {
@@ -12,10 +12,42 @@
 #include "../stringlib/stringlib.h"
 #include "../stringlib/b64.h"
 
+#define B64_LINE_SIZE   76
+
+/*
+ * Output sink, 'buf' is always NUL-terminated.
+ */
+typedef int (*MimeWriter)( void * ctx, const char * buf, size_t size );
+
+/*
+ * Streaming base64 encoder: B64_LINE_SIZE columns, CRLF between lines.
+ */
+typedef struct _B64Stream
+{
+    MimeWriter writer;
+    void * ctx;
+    unsigned char carry[3];
+    size_t ncarry;
+    size_t col;
+    size_t nout;
+    char out[4097];
+} B64Stream;
+
+void b64_StreamInit( B64Stream * s, MimeWriter writer, void * ctx );
+int b64_StreamWrite( B64Stream * s, const void * buf, size_t size );
+int b64_StreamEnd( B64Stream * s );
+size_t b64_EncodedSize( size_t size );
+
 int isUsAscii( const char * s );
 int isUsAsciiCs( const char * charset );
+int isUtf8Cs( const char * charset );
 string mimeFileName( const char * name, const char * charset );
 const char * getMimeType( const char * filename, const char * ctype );
+/*
+ * Per-thread xorshift64* generator, seeded on first use in each thread.
+ * Fast and unpredictable enough for boundaries and IDs, not for keys.
+ */
+unsigned long long mime_Random( void );
 char * mimeMakeBoundary( char * boundary );
 
 #endif /* MIME_H_ */
@@ -0,0 +1,342 @@
+/*
+ * rcpt.c, part of "ksmtp" project.
+ */
+
+#include "rcpt.h"
+#include "addr.h"
+
+#define RCPT_TABLE_SIZE     64
+
+static size_t rcptHash( const char * s )
+{
+    size_t h = 2166136261u;
+    while( *s )
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Lowercased e-mail without surrounding spaces and trailing dot in domain.
+ */
+static char * rcptKey( const char * email )
+{
+    size_t size;
+    char * key;
+    char * ptr;
+
+    while( *email == ' ' || *email == '\t' )
+        email++;
+    key = Strdup( email );
+    if( !key ) return NULL;
+    size = strlen( key );
+    while( size && (key[size - 1] == ' ' || key[size - 1] == '\t'
+            || key[size - 1] == '.') )
+        key[--size] = 0;
+    for( ptr = key; *ptr; ptr++ )
+        *ptr = tolower( (unsigned char)*ptr );
+    return key;
+}
+
+static const char * rcptDomainName( const char * key )
+{
+    const char * at = strrchr( key, '@' );
+    return at ? at + 1 : "";
+}
+
+RcptSet rcpt_Create( void )
+{
+    RcptSet set = Calloc( sizeof(struct _RcptSet), 1 );
+    if( !set ) return NULL;
+    set->tsize = RCPT_TABLE_SIZE;
+    set->dsize = RCPT_TABLE_SIZE;
+    set->table = Calloc( sizeof(Rcpt), set->tsize );
+    set->dtable = Calloc( sizeof(RcptDomain), set->dsize );
+    if( !set->table || !set->dtable )
+    {
+        rcpt_Destroy( set );
+        return NULL;
+    }
+    return set;
+}
+
+static void delRcpt( Rcpt rcpt )
+{
+    deleteAddr( rcpt->addr );
+    Free( rcpt->key );
+    Free( rcpt );
+}
+
+static void delDomain( RcptDomain domain )
+{
+    Free( domain->name );
+    Free( domain );
+}
+
+void rcpt_Destroy( RcptSet set )
+{
+    RcptDomain domain;
+    int kind;
+
+    if( !set ) return;
+    for( kind = 0; kind < RCPT_KINDS; kind++ )
+    {
+        Rcpt rcpt = set->first[kind];
+        while( rcpt )
+        {
+            Rcpt next = rcpt->next;
+            delRcpt( rcpt );
+            rcpt = next;
+        }
+    }
+    domain = set->dfirst;
+    while( domain )
+    {
+        RcptDomain next = domain->next;
+        delDomain( domain );
+        domain = next;
+    }
+    Free( set->table );
+    Free( set->dtable );
+    Free( set );
+}
+
+static int growTable( RcptSet set )
+{
+    size_t tsize = set->tsize * 2;
+    size_t i;
+    Rcpt * table = Calloc( sizeof(Rcpt), tsize );
+    if( !table ) return 0;
+
+    for( i = 0; i < set->tsize; i++ )
+    {
+        Rcpt rcpt = set->table[i];
+        while( rcpt )
+        {
+            Rcpt next = rcpt->hnext;
+            rcpt->hnext = table[rcpt->hash & (tsize - 1)];
+            table[rcpt->hash & (tsize - 1)] = rcpt;
+            rcpt = next;
+        }
+    }
+    Free( set->table );
+    set->table = table;
+    set->tsize = tsize;
+    return 1;
+}
+
+static int growDomains( RcptSet set )
+{
+    size_t dsize = set->dsize * 2;
+    size_t i;
+    RcptDomain * dtable = Calloc( sizeof(RcptDomain), dsize );
+    if( !dtable ) return 0;
+
+    for( i = 0; i < set->dsize; i++ )
+    {
+        RcptDomain domain = set->dtable[i];
+        while( domain )
+        {
+            RcptDomain next = domain->hnext;
+            domain->hnext = dtable[domain->hash & (dsize - 1)];
+            dtable[domain->hash & (dsize - 1)] = domain;
+            domain = next;
+        }
+    }
+    Free( set->dtable );
+    set->dtable = dtable;
+    set->dsize = dsize;
+    return 1;
+}
+
+static Rcpt findKey( RcptSet set, const char * key, size_t hash )
+{
+    Rcpt rcpt = set->table[hash & (set->tsize - 1)];
+    while( rcpt )
+    {
+        if( rcpt->hash == hash && !strcmp( rcpt->key, key ) ) return rcpt;
+        rcpt = rcpt->hnext;
+    }
+    return NULL;
+}
+
+static RcptDomain getDomain( RcptSet set, const char * name )
+{
+    size_t hash = rcptHash( name );
+    RcptDomain domain = set->dtable[hash & (set->dsize - 1)];
+
+    while( domain )
+    {
+        if( domain->hash == hash && !strcmp( domain->name, name ) ) return domain;
+        domain = domain->hnext;
+    }
+
+    if( set->dcount >= set->dsize - set->dsize / 4 && !growDomains( set ) ) return NULL;
+    domain = Calloc( sizeof(struct _RcptDomain), 1 );
+    if( !domain ) return NULL;
+    domain->name = Strdup( name );
+    if( !domain->name )
+    {
+        Free( domain );
+        return NULL;
+    }
+    domain->hash = hash;
+    domain->hnext = set->dtable[hash & (set->dsize - 1)];
+    set->dtable[hash & (set->dsize - 1)] = domain;
+    domain->prev = set->dlast;
+    if( set->dlast ) set->dlast->next = domain;
+    else set->dfirst = domain;
+    set->dlast = domain;
+    set->dcount++;
+    return domain;
+}
+
+static void linkKind( RcptSet set, Rcpt rcpt )
+{
+    rcpt->next = NULL;
+    rcpt->prev = set->last[rcpt->kind];
+    if( rcpt->prev ) rcpt->prev->next = rcpt;
+    else set->first[rcpt->kind] = rcpt;
+    set->last[rcpt->kind] = rcpt;
+    set->size[rcpt->kind]++;
+}
+
+static void unlinkKind( RcptSet set, Rcpt rcpt )
+{
+    if( rcpt->prev ) rcpt->prev->next = rcpt->next;
+    else set->first[rcpt->kind] = rcpt->next;
+    if( rcpt->next ) rcpt->next->prev = rcpt->prev;
+    else set->last[rcpt->kind] = rcpt->prev;
+    set->size[rcpt->kind]--;
+}
+
+int rcpt_Add( RcptSet set, const char * src, RcptKind kind )
+{
+    Rcpt rcpt;
+    char * key;
+    size_t hash;
+    Pair addr = createAddr( src );
+    if( !addr ) return 0;
+
+    key = rcptKey( A_EMAIL(addr) );
+    if( !key )
+    {
+        deleteAddr( addr );
+        return 0;
+    }
+    hash = rcptHash( key );
+
+    rcpt = findKey( set, key, hash );
+    if( rcpt )
+    {
+        Free( key );
+        if( kind < rcpt->kind )
+        {
+            unlinkKind( set, rcpt );
+            rcpt->kind = kind;
+            linkKind( set, rcpt );
+            deleteAddr( rcpt->addr );
+            rcpt->addr = addr;
+        }
+        else deleteAddr( addr );
+        return 2;
+    }
+
+    if( set->count >= set->tsize - set->tsize / 4 && !growTable( set ) )
+    {
+        Free( key );
+        deleteAddr( addr );
+        return 0;
+    }
+    rcpt = Calloc( sizeof(struct _Rcpt), 1 );
+    if( !rcpt )
+    {
+        Free( key );
+        deleteAddr( addr );
+        return 0;
+    }
+    rcpt->addr = addr;
+    rcpt->key = key;
+    rcpt->hash = hash;
+    rcpt->kind = kind;
+    rcpt->domain = getDomain( set, rcptDomainName( key ) );
+    if( !rcpt->domain )
+    {
+        delRcpt( rcpt );
+        return 0;
+    }
+
+    rcpt->hnext = set->table[hash & (set->tsize - 1)];
+    set->table[hash & (set->tsize - 1)] = rcpt;
+    set->count++;
+
+    rcpt->dprev = rcpt->domain->last;
+    if( rcpt->dprev ) rcpt->dprev->dnext = rcpt;
+    else rcpt->domain->first = rcpt;
+    rcpt->domain->last = rcpt;
+    rcpt->domain->count++;
+
+    linkKind( set, rcpt );
+    return 1;
+}
+
+Rcpt rcpt_Find( RcptSet set, const char * email )
+{
+    Rcpt rcpt;
+    char * key = rcptKey( email );
+    if( !key ) return NULL;
+    rcpt = findKey( set, key, rcptHash( key ) );
+    Free( key );
+    return rcpt;
+}
+
+static void removeDomain( RcptSet set, RcptDomain domain )
+{
+    RcptDomain * ptr = &set->dtable[domain->hash & (set->dsize - 1)];
+    while( *ptr != domain )
+        ptr = &(*ptr)->hnext;
+    *ptr = domain->hnext;
+
+    if( domain->prev ) domain->prev->next = domain->next;
+    else set->dfirst = domain->next;
+    if( domain->next ) domain->next->prev = domain->prev;
+    else set->dlast = domain->prev;
+    set->dcount--;
+    delDomain( domain );
+}
+
+static void removeRcpt( RcptSet set, Rcpt rcpt )
+{
+    RcptDomain domain = rcpt->domain;
+    Rcpt * ptr = &set->table[rcpt->hash & (set->tsize - 1)];
+    while( *ptr != rcpt )
+        ptr = &(*ptr)->hnext;
+    *ptr = rcpt->hnext;
+    set->count--;
+
+    unlinkKind( set, rcpt );
+
+    if( rcpt->dprev ) rcpt->dprev->dnext = rcpt->dnext;
+    else domain->first = rcpt->dnext;
+    if( rcpt->dnext ) rcpt->dnext->dprev = rcpt->dprev;
+    else domain->last = rcpt->dprev;
+    if( !--domain->count ) removeDomain( set, domain );
+
+    delRcpt( rcpt );
+}
+
+int rcpt_Remove( RcptSet set, const char * email )
+{
+    Rcpt rcpt = rcpt_Find( set, email );
+    if( !rcpt ) return 0;
+    removeRcpt( set, rcpt );
+    return 1;
+}
+
+void rcpt_Clear( RcptSet set, RcptKind kind )
+{
+    while( set->first[kind] )
+        removeRcpt( set, set->first[kind] );
+}
@@ -0,0 +1,78 @@
+/*
+ * rcpt.h, part of "ksmtp" project.
+ */
+
+#ifndef RCPT_H_
+#define RCPT_H_
+
+#include "../klib/plist.h"
+
+typedef enum _RcptKind
+{
+    RCPT_TO = 0, RCPT_CC = 1, RCPT_BCC = 2, RCPT_KINDS = 3
+} RcptKind;
+
+struct _RcptDomain;
+
+/*
+ * One recipient. Key is the lowercased e-mail, it is unique across
+ * To/Cc/Bcc: the most visible kind wins (To > Cc > Bcc).
+ */
+typedef struct _Rcpt
+{
+    Pair addr;
+    char * key;
+    size_t hash;
+    RcptKind kind;
+    struct _Rcpt * hnext;
+    struct _Rcpt * prev;
+    struct _Rcpt * next;
+    struct _Rcpt * dprev;
+    struct _Rcpt * dnext;
+    struct _RcptDomain * domain;
+}*Rcpt;
+
+typedef struct _RcptDomain
+{
+    char * name;
+    size_t hash;
+    size_t count;
+    Rcpt first;
+    Rcpt last;
+    struct _RcptDomain * hnext;
+    struct _RcptDomain * prev;
+    struct _RcptDomain * next;
+}*RcptDomain;
+
+typedef struct _RcptSet
+{
+    Rcpt * table;
+    size_t tsize;
+    size_t count;
+    RcptDomain * dtable;
+    size_t dsize;
+    size_t dcount;
+    RcptDomain dfirst;
+    RcptDomain dlast;
+    Rcpt first[RCPT_KINDS];
+    Rcpt last[RCPT_KINDS];
+    size_t size[RCPT_KINDS];
+}*RcptSet;
+
+RcptSet rcpt_Create( void );
+void rcpt_Destroy( RcptSet set );
+
+/*
+ * Returns 0 on error, 1 if added, 2 if it was a duplicate.
+ */
+int rcpt_Add( RcptSet set, const char * src, RcptKind kind );
+Rcpt rcpt_Find( RcptSet set, const char * email );
+int rcpt_Remove( RcptSet set, const char * email );
+void rcpt_Clear( RcptSet set, RcptKind kind );
+
+#define rcpt_Size( set, kind )  (set)->size[(kind)]
+#define rcpt_First( set, kind ) (set)->first[(kind)]
+#define RCPT_EMAIL( rcpt )      (rcpt)->addr->second
+#define RCPT_NAME( rcpt )       (rcpt)->addr->first
+
+#endif /* RCPT_H_ */